@@ -31,3 +31,57 @@ String BinaryOperation::str( int ident ){
             << rhs.str( ident + 1 );
     return stream.str();
 }
+
+String PrintfMethodCall::formatString() const {
+    String fmt = format.substr(1, format.size()-2);
+
+    std::string result;
+    for( size_t i = 0; i < fmt.size(); ++i ){
+        if( fmt[i] != '\\' || i + 1 == fmt.size() ){
+            result += fmt[i];
+            continue;
+        }
+        switch( fmt[++i] ){
+        case 'n':  result += '\n'; break;
+        case 't':  result += '\t'; break;
+        case '"':  result += '"';  break;
+        case '\\': result += '\\'; break;
+        default:   result += '\\'; result += fmt[i]; break;
+        }
+    }
+    return result;
+}
+
+/* -- Destructors, every node owns the nodes below it -- */
+
+template <typename T>
+static void deleteAll( std::vector<T*>& nodes ){
+    for( size_t i = 0; i < nodes.size(); ++i ){
+        delete nodes[i];
+    }
+    nodes.clear();
+}
+
+StatementBlock::~StatementBlock(){
+    deleteAll( statements );
+}
+
+MethodCall::~MethodCall(){
+    delete &methodName;
+    deleteAll( arguments );
+}
+
+PrintfMethodCall::~PrintfMethodCall(){
+    deleteAll( arguments );
+}
+
+SwitchStatement::~SwitchStatement(){
+    delete testExpression;
+    deleteAll( cases );
+}
+
+FunctionDeclaration::~FunctionDeclaration(){
+    delete &functionType;
+    delete &functionName;
+    deleteAll( arguments );
+}
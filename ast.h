@@ -28,9 +28,15 @@ typedef std::vector<Expression*> ExpressionList;
 typedef std::vector<VariableDeclaration*> VariableList;
 
 
+extern int lineNumber;
+
 class Node{
 public:
-    //virtual ~Node();
+    /* source line, the one being lexed when the node was built */
+    int line;
+
+    Node() : line( lineNumber ) { }
+    virtual ~Node() { }
     virtual String str( int ident = 0 ) { return "Node"; }
     virtual llvm::Value* codeGen(CodeGenContext& context) { return 0; }
 };
@@ -48,6 +54,7 @@ public:
     const String& name;
 
     Identifier( const String& name ) : name(name) { }
+    ~Identifier() { delete &name; }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
@@ -80,16 +87,26 @@ public:
 
     BinaryOperation( int op, Expression& lhs, Expression& rhs ) :
         op(op), lhs(lhs), rhs(rhs) {}
+    ~BinaryOperation() { delete &lhs; delete &rhs; }
 
     String str( int ident = 0 );
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
 
+/* Owns its statements, they are moved between blocks with swap */
 class StatementBlock: public Expression {
 public:
     StatementList statements;
+
+    StatementBlock() { }
+    ~StatementBlock();
+
     virtual llvm::Value* codeGen(CodeGenContext& context);
+
+private:
+    StatementBlock( const StatementBlock& );
+    StatementBlock& operator=( const StatementBlock& );
 };
 
 class MethodCall : public Expression {
@@ -103,6 +120,8 @@ public:
     MethodCall( const Identifier& name ) :
         methodName(name) { }
 
+    ~MethodCall();
+
     //virtual String str( int ident );
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
@@ -123,6 +142,11 @@ public:
     PrintfMethodCall( const String& format, ExpressionList& args ) :
         format( format ), arguments( args ) { }
 
+    ~PrintfMethodCall();
+
+    /* format without the quotes and with its escapes replaced */
+    String formatString() const;
+
     virtual llvm::Value* codeGen(CodeGenContext& context);
 
 private:
@@ -136,10 +160,12 @@ public:
     
     Assignment( const Identifier& lhs, Expression* rhs ) :
         lhs(lhs), rhs(rhs) { }
+    ~Assignment() { delete &lhs; delete rhs; }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
 
+/* The statements of the blocks passed in move to the branch */
 class BranchStatement: public Statement {
 public:
     Expression* testExpression;
@@ -147,11 +173,20 @@ public:
     StatementBlock blockFalse;
     bool hasFalseBranch;
     
-    BranchStatement( Expression* test, StatementBlock& blockTrue, StatementBlock blockFalse ) :
-        testExpression( test ), blockTrue( blockTrue ), blockFalse( blockFalse ), hasFalseBranch(true) { }
+    BranchStatement( Expression* test, StatementBlock& blockTrue, StatementBlock& blockFalse ) :
+        testExpression( test ), hasFalseBranch(true) {
+        line = test->line;
+        this->blockTrue.statements.swap( blockTrue.statements );
+        this->blockFalse.statements.swap( blockFalse.statements );
+    }
 
     BranchStatement( Expression* test, StatementBlock& blockTrue ) :
-        testExpression( test ), blockTrue( blockTrue ), hasFalseBranch(false) { }
+        testExpression( test ), hasFalseBranch(false) {
+        line = test->line;
+        this->blockTrue.statements.swap( blockTrue.statements );
+    }
+
+    ~BranchStatement() { delete testExpression; }
 
     String getUniqueName(){
         char buffer[16];
@@ -166,11 +201,51 @@ private:
     static int instanceCount;
 };
 
+class SwitchCase {
+public:
+    int value;
+    bool isDefault;
+    StatementBlock block;
+
+    SwitchCase( int value, StatementBlock& block ) :
+        value( value ), isDefault( false ) { this->block.statements.swap( block.statements ); }
+
+    SwitchCase( StatementBlock& block ) :
+        value( 0 ), isDefault( true ) { this->block.statements.swap( block.statements ); }
+};
+
+typedef std::vector<SwitchCase*> SwitchCaseList;
+
+/* Cases do not fall through, the default case is one of cases */
+class SwitchStatement: public Statement {
+public:
+    Expression* testExpression;
+    SwitchCaseList cases;
+
+    SwitchStatement( Expression* test, SwitchCaseList& cases ) :
+        testExpression( test ), cases( cases ) { line = test->line; }
+
+    ~SwitchStatement();
+
+    String getUniqueName(){
+        char buffer[16];
+        sprintf( buffer, "switch%d", instanceCount );
+        instanceCount += 1;
+        return buffer;
+    }
+
+    virtual llvm::Value* codeGen(CodeGenContext& context);
+
+private:
+    static int instanceCount;
+};
+
 class ReturnStatement: public Statement {
 public:
     Expression* value;
     ReturnStatement( Expression* value ) :
         value( value ) { }
+    ~ReturnStatement() { delete value; }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
@@ -181,11 +256,50 @@ public:
     const Identifier& functionName;
     VariableList arguments;
     StatementBlock block;
+    bool isPure;
+    bool isReadNone;
+    bool isMemoized;
 
     FunctionDeclaration( const Identifier& type, const Identifier& name, VariableList args, StatementBlock& block ) :
-        functionType(type), functionName(name), arguments(args), block(block) { }
+        functionType(type), functionName(name), arguments(args), isPure(false), isReadNone(false), isMemoized(false) {
+        line = name.line;
+        this->block.statements.swap( block.statements );
+    }
+
+    ~FunctionDeclaration();
+
+    virtual llvm::Value* codeGen(CodeGenContext& context);
+};
+
+class SpawnStatement : public Statement {
+public:
+    const Identifier* target;
+    MethodCall& call;
+
+    SpawnStatement( MethodCall& call ) :
+        target( NULL ), call( call ) { }
+
+    SpawnStatement( const Identifier& target, MethodCall& call ) :
+        target( &target ), call( call ) { }
+
+    ~SpawnStatement() { delete target; delete &call; }
+
+    static String getUniqueName() {
+        char buffer[16];
+        sprintf( buffer, "spawn%d", instanceCount );
+        instanceCount += 1;
+        return buffer;
+    }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
+
+private:
+    static int instanceCount;
+};
+
+class SyncStatement : public Statement {
+public:
+    virtual llvm::Value* codeGen(CodeGenContext& context);
 };
 
 class ExpressionStatement : public Statement {
@@ -193,7 +307,8 @@ public:
     Expression& expression;
 
     ExpressionStatement( Expression& expression ) :
-        expression( expression ) { }
+        expression( expression ) { line = expression.line; }
+    ~ExpressionStatement() { delete &expression; }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
@@ -205,12 +320,22 @@ public:
     Expression* assignmentExpression;
 
     VariableDeclaration( const Identifier& type, const Identifier& name ) :
-        type(type), name(name) { }
+        type(type), name(name), assignmentExpression(NULL) { line = name.line; }
 
     VariableDeclaration( const Identifier& type, const Identifier& name, Expression* value ) :
-        type(type), name(name), assignmentExpression(value) { }
+        type(type), name(name), assignmentExpression(value) { line = name.line; }
+
+    ~VariableDeclaration() { delete &type; delete &name; delete assignmentExpression; }
 
     virtual llvm::Value* codeGen(CodeGenContext& context);
 };
 
+/* Receives each top level statement as soon as it is parsed, see
+   topLevelHandler in parser.y. The statement is the handler's to delete */
+class TopLevelHandler {
+public:
+    virtual ~TopLevelHandler() { }
+    virtual void topLevel( Statement* statement ) = 0;
+};
+
 #endif
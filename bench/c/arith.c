@@ -0,0 +1,36 @@
+#include <stdio.h>
+
+/* poulp int arithmetic wraps, unsigned gives C the same behaviour */
+static int mix(int h, int x) {
+    return (int)((unsigned)h * 31u + (unsigned)x * (unsigned)x - (unsigned)(x / 7));
+}
+
+static int hashrange(int lo, int hi) {
+    if (hi - lo < 2)
+        return mix(lo, hi);
+    int mid = lo + (hi - lo) / 2;
+    return mix(hashrange(lo, mid), hashrange(mid, hi));
+}
+
+static int mod(int a, int b) {
+    return a - a / b * b;
+}
+
+static int gcd(int a, int b) {
+    if (b == 0)
+        return a;
+    return gcd(b, mod(a, b));
+}
+
+static int gcdsum(int lo, int hi) {
+    if (hi - lo < 2)
+        return gcd(lo * 7 + 3, lo * 5 + 1);
+    int mid = lo + (hi - lo) / 2;
+    return (int)((unsigned)gcdsum(lo, mid) + (unsigned)gcdsum(mid, hi));
+}
+
+int main(void) {
+    printf("%d\n", hashrange(0, 8000000));
+    printf("%d\n", gcdsum(1, 2000000));
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+
+static int classify(int x) {
+    int h = (int)((unsigned)x * 1103515245u + 12345u);
+    int r = h / 65536 - h / 65536 / 100 * 100;
+    if (r < 0)
+        r = 0 - r;
+    if (r < 50) {
+        if (r < 25) {
+            if (r < 10)
+                return 1;
+            else
+                return 2;
+        } else {
+            if (r == 30)
+                return 7;
+            return 3;
+        }
+    } else {
+        if (r > 90)
+            return 4;
+        if (r == 77)
+            return 8;
+        if (r > 60)
+            return 5;
+        else
+            return 6;
+    }
+    return 0;
+}
+
+static int score(int lo, int hi) {
+    if (hi - lo < 2)
+        return classify(lo);
+    int mid = lo + (hi - lo) / 2;
+    return score(lo, mid) + score(mid, hi);
+}
+
+int main(void) {
+    printf("%d\n", score(0, 6000000));
+    return 0;
+}
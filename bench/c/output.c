@@ -0,0 +1,15 @@
+#include <stdio.h>
+
+static int emit(int lo, int hi) {
+    if (hi - lo < 2) {
+        printf("line %d value %d\n", lo, lo * 3 + 1);
+        return 1;
+    }
+    int mid = lo + (hi - lo) / 2;
+    return emit(lo, mid) + emit(mid, hi);
+}
+
+int main(void) {
+    printf("%d\n", emit(0, 1000000));
+    return 0;
+}
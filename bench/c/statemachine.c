@@ -0,0 +1,55 @@
+#include <stdio.h>
+
+static int input(int x) {
+    int h = (int)((unsigned)x * 1103515245u + 12345u);
+    int r = h / 65536 - h / 65536 / 8 * 8;
+    if (r < 0)
+        return 0 - r;
+    return r;
+}
+
+static int next(int state, int symbol) {
+    switch (state) {
+    case 0:
+        if (symbol < 3)
+            return 1;
+        return 2;
+    case 1:
+        return symbol;
+    case 2:
+        if (symbol == 7)
+            return 0;
+        return 3;
+    case 3:
+        return 7 - symbol;
+    case 4:
+        return 5;
+    case 5:
+        if (symbol > 4)
+            return 6;
+        return 4;
+    case 6:
+        return (symbol + state) / 2;
+    default:
+        return 0;
+    }
+}
+
+static int run(int state, int lo, int hi) {
+    if (hi - lo < 2)
+        return next(state, input(lo));
+    int mid = lo + (hi - lo) / 2;
+    return run(run(state, lo, mid), mid, hi);
+}
+
+static int count(int lo, int hi) {
+    if (hi - lo < 2)
+        return run(lo - lo / 8 * 8, 0, 200);
+    int mid = lo + (hi - lo) / 2;
+    return count(lo, mid) + count(mid, hi);
+}
+
+int main(void) {
+    printf("%d\n", count(0, 40000));
+    return 0;
+}
@@ -0,0 +1,170 @@
+#!/bin/bash
+#
+# Runtime benchmarks of the code generated by lft-cc.
+#
+# Every bench/*.poulp program is compiled at -O0..-O3 (opt + llc), run
+# RUNS times and reported with its median cpu time (user + system, so the
+# time spent waiting for a busy machine is left out) and binary size, next to
+# the same program in bench/c/ compiled by clang at the same level and to
+# the numbers stored in bench/baseline.txt.
+#
+# usage: bench/run.sh [ --update-baseline ]
+#
+# RUNS, THRESHOLD (percent of slowdown or growth reported as a regression),
+# MARCH, MATTR, LFTFLAGS (extra lft-cc options), LLVM_SUFFIX and CLANG can
+# be set in the environment. The exit status is 1 when a program regressed
+# or printed something else than its C version. Without a baseline the
+# regression check is skipped, it does not fail the run.
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+
+RUNS=${RUNS:-5}
+THRESHOLD=${THRESHOLD:-10}
+LEVELS="0 1 2 3"
+LLVM_SUFFIX=${LLVM_SUFFIX--3.4}
+CLANG=${CLANG:-clang}
+
+LFTCC=$ROOT/lft-cc
+RUNTIME=$ROOT/runtime/poulprt.o
+BASELINE=$BENCH/baseline.txt
+
+UPDATE_BASELINE=0
+if [ "$1" == "--update-baseline" ]; then
+    UPDATE_BASELINE=1
+fi
+
+for tool in "$LFTCC" "$RUNTIME"; do
+    if [ ! -e "$tool" ]; then
+        echo "missing $tool, run make lft-cc runtime/poulprt.o" >&2
+        exit 2
+    fi
+done
+
+# the target as resolved by lft-cc, for opt and llc
+LFTTARGET="${MARCH:+-march=$MARCH} ${MATTR:+-mattr=$MATTR}"
+TARGET_FLAGS=$("$LFTCC" $LFTTARGET --print-target-flags) || exit 2
+
+if [ "$UPDATE_BASELINE" == "0" ] && [ ! -e "$BASELINE" ]; then
+    echo "no $BASELINE: the regression check will be skipped, run make bench-baseline to create it" >&2
+fi
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# median cpu time (user + system) of RUNS runs of $1, in seconds, as
+# measured by the shell's time keyword rather than forked clock reads
+measure() {
+    local TIMEFORMAT='%3U %3S'
+    for i in $(seq "$RUNS"); do
+        { time "$1" > /dev/null 2>&1 ; } 2>&1 | awk '{ printf "%.3f\n", $1 + $2 }'
+    done | median
+}
+
+size_of() {
+    stat -c %s "$1"
+}
+
+# compile_poulp <name> <level>: bench/<name>.poulp to $WORK/<name>.O<level>
+compile_poulp() {
+    local name=$1 level=$2
+    local dir=$WORK/$name
+    mkdir -p "$dir"
+
+    if [ ! -e "$dir/out.ll" ]; then
+        (cd "$dir" && "$LFTCC" $LFTTARGET $LFTFLAGS "$BENCH/$name.poulp" > lft-cc.log) || return 1
+    fi
+
+    if [ "$level" == "0" ]; then
+        llvm-as$LLVM_SUFFIX -f "$dir/out.ll" -o "$dir/O$level.bc" || return 1
+    else
+        opt$LLVM_SUFFIX -O$level $TARGET_FLAGS "$dir/out.ll" -o "$dir/O$level.bc" || return 1
+    fi
+    llc$LLVM_SUFFIX -O$level $TARGET_FLAGS -o "$dir/O$level.s" "$dir/O$level.bc" || return 1
+    gcc -o "$WORK/$name.O$level" "$dir/O$level.s" "$RUNTIME" -lpthread -lstdc++ || return 1
+}
+
+# compile_c <name> <level>: bench/c/<name>.c to $WORK/<name>.c.O<level>
+compile_c() {
+    local name=$1 level=$2
+    $CLANG -O$level ${MARCH:+-march=$MARCH} -o "$WORK/$name.c.O$level" "$BENCH/c/$name.c"
+}
+
+# baseline <name> <level> <field>: field 3 is the time, 4 the size
+baseline() {
+    [ -e "$BASELINE" ] && awk -v n="$1" -v l="O$2" -v f="$3" '$1 == n && $2 == l { print $f }' "$BASELINE"
+}
+
+status=0
+results=$WORK/results.txt
+
+printf "%-10s %-3s %9s %9s %9s %9s %7s %9s %8s\n" \
+    program opt time size c-time c-size vs-c baseline change
+
+for source in "$BENCH"/*.poulp; do
+    name=$(basename "$source" .poulp)
+
+    for level in $LEVELS; do
+        if ! compile_poulp "$name" "$level"; then
+            echo "$name: compilation at -O$level failed" >&2
+            status=1
+            continue
+        fi
+        binary=$WORK/$name.O$level
+        time=$(measure "$binary")
+        size=$(size_of "$binary")
+        echo "$name O$level $time $size" >> "$results"
+
+        c_time="-"
+        c_size="-"
+        ratio="-"
+        if [ -e "$BENCH/c/$name.c" ] && compile_c "$name" "$level"; then
+            if ! cmp -s <("$binary") <("$WORK/$name.c.O$level"); then
+                echo "$name: -O$level output differs from the C version" >&2
+                status=1
+            fi
+            c_time=$(measure "$WORK/$name.c.O$level")
+            c_size=$(size_of "$WORK/$name.c.O$level")
+            ratio=$(awk "BEGIN { if ($c_time > 0) printf \"%.2fx\", $time / $c_time; else print \"-\" }")
+        fi
+
+        base_time=$(baseline "$name" "$level" 3)
+        base_size=$(baseline "$name" "$level" 4)
+        change="-"
+        if [ -n "$base_time" ]; then
+            change=$(awk "BEGIN { if ($base_time > 0) printf \"%+.1f%%\", ($time - $base_time) * 100 / $base_time; else print \"-\" }")
+            slower=$(awk "BEGIN { print ($time > $base_time * (1 + $THRESHOLD / 100.0)) }")
+            bigger=$(awk "BEGIN { print ($size > $base_size * (1 + $THRESHOLD / 100.0)) }")
+            if [ "$slower" == "1" ] || [ "$bigger" == "1" ]; then
+                change="$change!"
+                status=1
+            fi
+        fi
+
+        printf "%-10s %-3s %9s %9s %9s %9s %7s %9s %8s\n" \
+            "$name" "O$level" "$time" "$size" "$c_time" "$c_size" "$ratio" "${base_time:--}" "$change"
+    done
+done
+
+if [ "$UPDATE_BASELINE" == "1" ]; then
+    {
+        echo "# program level median-cpu-seconds binary-bytes, written by bench/run.sh --update-baseline"
+        cat "$results"
+    } > "$BASELINE"
+    echo "baseline written to $BASELINE"
+    exit 0
+fi
+
+if [ ! -e "$BASELINE" ]; then
+    echo "SKIPPED regression check: no $BASELINE, only the outputs were compared with C" >&2
+fi
+
+if [ "$status" != "0" ]; then
+    echo "regressions found (! marks more than $THRESHOLD% slower or bigger than the baseline)" >&2
+fi
+exit $status
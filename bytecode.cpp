@@ -0,0 +1,456 @@
+#include "bytecode.h"
+#include "log.h"
+#include "parser.hpp"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <typeinfo>
+
+using namespace std;
+
+ValueType valueTypeOf(const Identifier& type){
+    if( type.name.compare("int") == 0 ){
+        return TYPE_INT;
+    } else if( type.name.compare("double") == 0 ){
+        return TYPE_DOUBLE;
+    }
+    return TYPE_VOID;
+}
+
+BytecodeProgram* BytecodeCompiler::compile(StatementBlock& root){
+    Log::Debug() << "Compiling bytecode...\n";
+
+    program = new BytecodeProgram();
+    program->functions.push_back(new BytecodeFunction("main", NULL));
+
+    /* every function is known before any body is compiled,
+       so calls may refer to functions declared later */
+    declareFunctions(root);
+
+    compileFunction(program->functions[0], root, NULL);
+    for( size_t i = 1; i < program->functions.size(); ++i ){
+        BytecodeFunction* current = program->functions[i];
+        compileFunction(current, current->declaration->block, &current->declaration->arguments);
+    }
+
+    Log::Debug() << "Bytecode is compiled.\n";
+    return program;
+}
+
+void BytecodeCompiler::declareFunctions(StatementBlock& block){
+    StatementList::iterator it;
+    for( it = block.statements.begin(); it != block.statements.end(); ++it ){
+        if( FunctionDeclaration* declaration = dynamic_cast<FunctionDeclaration*>(*it) ){
+            BytecodeFunction* declared = new BytecodeFunction(declaration->functionName.name, declaration);
+            declared->returnType = valueTypeOf(declaration->functionType);
+            declared->usesRuntime = declaration->isMemoized;
+
+            VariableList::iterator arg;
+            for( arg = declaration->arguments.begin(); arg != declaration->arguments.end(); ++arg ){
+                declared->argumentTypes.push_back(valueTypeOf((*arg)->type));
+            }
+            /* like codegen, memo is ignored on impure and void functions */
+            declared->memoized = declaration->isMemoized && declaration->isPure && declared->returnType != TYPE_VOID;
+
+            functionIndex[declared->name] = program->functions.size();
+            program->functions.push_back(declared);
+
+            declareFunctions(declaration->block);
+        } else if( BranchStatement* branch = dynamic_cast<BranchStatement*>(*it) ){
+            declareFunctions(branch->blockTrue);
+            declareFunctions(branch->blockFalse);
+        } else if( SwitchStatement* statement = dynamic_cast<SwitchStatement*>(*it) ){
+            SwitchCaseList::iterator c;
+            for( c = statement->cases.begin(); c != statement->cases.end(); ++c ){
+                declareFunctions((*c)->block);
+            }
+        }
+    }
+}
+
+void BytecodeCompiler::compileFunction(BytecodeFunction* compiled, StatementBlock& body, VariableList* arguments){
+    function = compiled;
+    nextRegister = 0;
+    scopes.clear();
+    scopes.push_back(map<String, Variable>());
+
+    if( arguments != NULL ){
+        VariableList::iterator it;
+        for( it = arguments->begin(); it != arguments->end(); ++it ){
+            declare((*it)->type, (*it)->name);
+        }
+    }
+
+    compileBlock(body);
+
+    /* falling off the end returns zero, like the native code */
+    if( function->returnType == TYPE_VOID ){
+        emit(BC_RETV);
+    } else {
+        int reg = allocate();
+        emit(BC_LOADI, reg, 0);
+        convert(reg, TYPE_INT, function->returnType);
+        emit(BC_RET, reg);
+    }
+
+    Log::Debug() << "Function " << function->name << ": " << function->code.size()
+                 << " instructions, " << function->registerCount << " registers\n";
+}
+
+void BytecodeCompiler::compileBlock(StatementBlock& block){
+    int mark = nextRegister;
+    scopes.push_back(scopes.back());
+
+    StatementList::iterator it;
+    for( it = block.statements.begin(); it != block.statements.end(); ++it ){
+        compileStatement(*it);
+    }
+
+    scopes.pop_back();
+    nextRegister = mark;
+}
+
+void BytecodeCompiler::compileStatement(Statement* statement){
+    /* declared variables keep their register until the end of the block,
+       everything else only needs registers while it runs */
+    if( VariableDeclaration* declaration = dynamic_cast<VariableDeclaration*>(statement) ){
+        Variable& variable = declare(declaration->type, declaration->name);
+        int mark = nextRegister;
+        if( declaration->assignmentExpression != NULL ){
+            ValueType type = compileExpression(declaration->assignmentExpression, variable.reg);
+            convert(variable.reg, type, variable.type);
+        } else {
+            emit(BC_LOADI, variable.reg, 0);
+            convert(variable.reg, TYPE_INT, variable.type);
+        }
+        nextRegister = mark;
+        return;
+    }
+
+    int mark = nextRegister;
+
+    if( ExpressionStatement* expression = dynamic_cast<ExpressionStatement*>(statement) ){
+        compileExpression(&expression->expression, allocate());
+    } else if( ReturnStatement* ret = dynamic_cast<ReturnStatement*>(statement) ){
+        if( function->returnType == TYPE_VOID ){
+            compileExpression(ret->value, allocate());
+            emit(BC_RETV);
+        } else {
+            int reg = allocate();
+            ValueType type = compileExpression(ret->value, reg);
+            convert(reg, type, function->returnType);
+            emit(BC_RET, reg);
+        }
+    } else if( BranchStatement* branch = dynamic_cast<BranchStatement*>(statement) ){
+        ValueType type;
+        int test = compileOperand(branch->testExpression, type);
+        if( type == TYPE_DOUBLE ){
+            int zero = allocate();
+            emit(BC_LOADD, zero, function->doubles.size());
+            function->doubles.push_back(0.0);
+            emit(BC_NED, zero, test, zero);
+            test = zero;
+        }
+
+        int jumpFalse = emit(BC_JMPF, test, -1);
+        compileBlock(branch->blockTrue);
+        if( branch->hasFalseBranch ){
+            int jumpEnd = emit(BC_JMP, -1);
+            function->code[jumpFalse].b = function->code.size();
+            compileBlock(branch->blockFalse);
+            function->code[jumpEnd].a = function->code.size();
+        } else {
+            function->code[jumpFalse].b = function->code.size();
+        }
+    } else if( SwitchStatement* switchStatement = dynamic_cast<SwitchStatement*>(statement) ){
+        compileSwitch(switchStatement);
+    } else if( SpawnStatement* spawn = dynamic_cast<SpawnStatement*>(statement) ){
+        /* the interpreter runs spawned calls in place, sync has nothing to wait for */
+        function->usesRuntime = true;
+        ValueType type;
+        if( spawn->target != NULL ){
+            Variable* variable = lookup(spawn->target->name);
+            if( variable == NULL ){
+                Log::Error() << "undeclared variable " << spawn->target->name << endl;
+                exit( -1 );
+            }
+            compileCall(spawn->call.methodName.name, spawn->call.arguments, variable->reg, type);
+            if( type == TYPE_VOID ){
+                Log::Error() << "void function " << spawn->call.methodName.name << " has no result for "
+                             << spawn->target->name << endl;
+                exit( -1 );
+            }
+            convert(variable->reg, type, variable->type);
+        } else {
+            compileCall(spawn->call.methodName.name, spawn->call.arguments, allocate(), type);
+        }
+    } else if( dynamic_cast<SyncStatement*>(statement) ){
+        function->usesRuntime = true;
+    } else if( dynamic_cast<FunctionDeclaration*>(statement) ){
+        /* compiled on its own */
+    } else {
+        Log::Error() << "unsupported statement " << typeid(*statement).name() << endl;
+        exit( -1 );
+    }
+
+    nextRegister = mark;
+}
+
+void BytecodeCompiler::compileSwitch(SwitchStatement* statement){
+    ValueType type;
+    int test = compileOperand(statement->testExpression, type);
+    if( type != TYPE_INT ){
+        Log::Error() << "switch needs an int value" << endl;
+        exit( -1 );
+    }
+
+    int index = function->switches.size();
+    function->switches.push_back(SwitchTable());
+    emit(BC_SWITCH, test, index);
+
+    vector< pair<int, int> > targets;
+    vector<int> jumpsToEnd;
+    int defaultTarget = -1;
+
+    SwitchCaseList::iterator it;
+    for( it = statement->cases.begin(); it != statement->cases.end(); ++it ){
+        int target = function->code.size();
+        if( (*it)->isDefault ){
+            if( defaultTarget != -1 ){
+                Log::Error() << "more than one default case" << endl;
+                exit( -1 );
+            }
+            defaultTarget = target;
+        } else {
+            targets.push_back(make_pair((*it)->value, target));
+        }
+        compileBlock((*it)->block);
+        jumpsToEnd.push_back(emit(BC_JMP, -1));
+    }
+
+    int end = function->code.size();
+    for( size_t i = 0; i < jumpsToEnd.size(); ++i ){
+        function->code[jumpsToEnd[i]].a = end;
+    }
+
+    SwitchTable& table = function->switches[index];
+    table.defaultTarget = defaultTarget == -1 ? end : defaultTarget;
+    table.low = 0;
+
+    sort(targets.begin(), targets.end());
+    for( size_t i = 0; i < targets.size(); ++i ){
+        if( i > 0 && targets[i].first == targets[i - 1].first ){
+            Log::Error() << "duplicate case " << targets[i].first << endl;
+            exit( -1 );
+        }
+        table.values.push_back(targets[i].first);
+        table.targets.push_back(targets[i].second);
+    }
+
+    /* dense enough for a direct table */
+    if( !targets.empty() ){
+        long long range = (long long)targets.back().first - targets.front().first + 1;
+        if( range <= 2 * (long long)targets.size() + 8 ){
+            table.low = targets.front().first;
+            table.dense.assign(range, table.defaultTarget);
+            for( size_t i = 0; i < targets.size(); ++i ){
+                table.dense[targets[i].first - table.low] = targets[i].second;
+            }
+        }
+    }
+}
+
+ValueType BytecodeCompiler::compileExpression(Expression* expression, int target){
+    if( Integer* integer = dynamic_cast<Integer*>(expression) ){
+        emit(BC_LOADI, target, integer->value);
+        return TYPE_INT;
+    }
+
+    if( Double* number = dynamic_cast<Double*>(expression) ){
+        emit(BC_LOADD, target, function->doubles.size());
+        function->doubles.push_back(number->value);
+        return TYPE_DOUBLE;
+    }
+
+    if( Identifier* identifier = dynamic_cast<Identifier*>(expression) ){
+        Variable* variable = lookup(identifier->name);
+        if( variable == NULL ){
+            Log::Error() << "undeclared variable " << identifier->name << endl;
+            exit( -1 );
+        }
+        emit(BC_MOVE, target, variable->reg);
+        return variable->type;
+    }
+
+    if( Assignment* assignment = dynamic_cast<Assignment*>(expression) ){
+        Variable* variable = lookup(assignment->lhs.name);
+        if( variable == NULL ){
+            Log::Error() << "undeclared variable " << assignment->lhs.name << endl;
+            exit( -1 );
+        }
+        ValueType type = compileExpression(assignment->rhs, variable->reg);
+        convert(variable->reg, type, variable->type);
+        emit(BC_MOVE, target, variable->reg);
+        return variable->type;
+    }
+
+    if( BinaryOperation* operation = dynamic_cast<BinaryOperation*>(expression) ){
+        ValueType lhsType, rhsType;
+        int lhs = compileOperand(&operation->lhs, lhsType);
+        int rhs = compileOperand(&operation->rhs, rhsType);
+
+        bool isDouble = lhsType == TYPE_DOUBLE || rhsType == TYPE_DOUBLE;
+        if( isDouble && lhsType != TYPE_DOUBLE ){
+            int reg = allocate();
+            emit(BC_I2D, reg, lhs);
+            lhs = reg;
+        }
+        if( isDouble && rhsType != TYPE_DOUBLE ){
+            int reg = allocate();
+            emit(BC_I2D, reg, rhs);
+            rhs = reg;
+        }
+
+        int op;
+        bool isComparison = false;
+        switch( operation->op ){
+        case T_PLUS:    op = isDouble ? BC_ADDD : BC_ADDI; break;
+        case T_MINUS:   op = isDouble ? BC_SUBD : BC_SUBI; break;
+        case T_MUL:     op = isDouble ? BC_MULD : BC_MULI; break;
+        case T_DIV:     op = isDouble ? BC_DIVD : BC_DIVI; break;
+        case T_CMP_EQ:  op = isDouble ? BC_EQD : BC_EQI; isComparison = true; break;
+        case T_CMP_NE:  op = isDouble ? BC_NED : BC_NEI; isComparison = true; break;
+        case T_CMP_LT:  op = isDouble ? BC_LTD : BC_LTI; isComparison = true; break;
+        case T_CMP_LE:  op = isDouble ? BC_LED : BC_LEI; isComparison = true; break;
+        case T_CMP_GT:  op = isDouble ? BC_GTD : BC_GTI; isComparison = true; break;
+        case T_CMP_GE:  op = isDouble ? BC_GED : BC_GEI; isComparison = true; break;
+        default:
+            Log::Error() << "unsupported operation " << operation->op << endl;
+            exit( -1 );
+        }
+        emit(op, target, lhs, rhs);
+
+        if( isComparison ){
+            return TYPE_INT;
+        }
+        return isDouble ? TYPE_DOUBLE : TYPE_INT;
+    }
+
+    if( MethodCall* call = dynamic_cast<MethodCall*>(expression) ){
+        ValueType type;
+        compileCall(call->methodName.name, call->arguments, target, type);
+        return type;
+    }
+
+    if( PrintfMethodCall* call = dynamic_cast<PrintfMethodCall*>(expression) ){
+        PrintfSite site;
+        site.format = call->formatString();
+
+        int base = nextRegister;
+        for( size_t i = 0; i < call->arguments.size(); ++i ){
+            allocate();
+        }
+        for( size_t i = 0; i < call->arguments.size(); ++i ){
+            site.argumentTypes.push_back(compileExpression(call->arguments[i], base + i));
+        }
+
+        emit(BC_PRINTF, target, function->printfs.size(), base);
+        function->printfs.push_back(site);
+        nextRegister = base;
+        return TYPE_INT;
+    }
+
+    Log::Error() << "unsupported expression " << typeid(*expression).name() << endl;
+    exit( -1 );
+    return TYPE_VOID;
+}
+
+/* Returns the register holding the value, variables are used in place */
+int BytecodeCompiler::compileOperand(Expression* expression, ValueType& type){
+    if( Identifier* identifier = dynamic_cast<Identifier*>(expression) ){
+        Variable* variable = lookup(identifier->name);
+        if( variable != NULL ){
+            type = variable->type;
+            return variable->reg;
+        }
+    }
+
+    int reg = allocate();
+    type = compileExpression(expression, reg);
+    return reg;
+}
+
+/* The arguments go to consecutive registers at the top of the frame,
+   which become the first registers of the callee */
+int BytecodeCompiler::compileCall(const String& name, ExpressionList& arguments, int target, ValueType& type){
+    map<String, int>::iterator it = functionIndex.find(name);
+    if( it == functionIndex.end() ){
+        Log::Error() << "no such function " << name << endl;
+        exit( -1 );
+    }
+
+    BytecodeFunction* callee = program->functions[it->second];
+    if( callee->argumentTypes.size() != arguments.size() ){
+        Log::Error() << "wrong number of arguments to " << name << endl;
+        exit( -1 );
+    }
+
+    int base = nextRegister;
+    for( size_t i = 0; i < arguments.size(); ++i ){
+        allocate();
+    }
+    for( size_t i = 0; i < arguments.size(); ++i ){
+        ValueType argumentType = compileExpression(arguments[i], base + i);
+        convert(base + i, argumentType, callee->argumentTypes[i]);
+    }
+
+    function->callees.push_back(it->second);
+    int index = emit(BC_CALL, target, it->second, base);
+    nextRegister = base;
+
+    type = callee->returnType;
+    return index;
+}
+
+void BytecodeCompiler::convert(int reg, ValueType from, ValueType to){
+    if( from == TYPE_INT && to == TYPE_DOUBLE ){
+        emit(BC_I2D, reg, reg);
+    } else if( from == TYPE_DOUBLE && to == TYPE_INT ){
+        emit(BC_D2I, reg, reg);
+    }
+}
+
+int BytecodeCompiler::allocate(){
+    int reg = nextRegister++;
+    if( nextRegister > function->registerCount ){
+        function->registerCount = nextRegister;
+    }
+    return reg;
+}
+
+int BytecodeCompiler::emit(int op, int a, int b, int c){
+    BytecodeInstruction instruction = { op, a, b, c };
+    function->code.push_back(instruction);
+    return function->code.size() - 1;
+}
+
+BytecodeCompiler::Variable* BytecodeCompiler::lookup(const String& name){
+    map<String, Variable>::iterator it = scopes.back().find(name);
+    if( it == scopes.back().end() ){
+        return NULL;
+    }
+    return &it->second;
+}
+
+BytecodeCompiler::Variable& BytecodeCompiler::declare(const Identifier& type, const Identifier& name){
+    Variable variable;
+    variable.reg = allocate();
+    variable.type = valueTypeOf(type);
+    if( variable.type == TYPE_VOID ){
+        Log::Error() << "unknown type " << type.name << " of " << name.name << endl;
+        exit( -1 );
+    }
+
+    scopes.back()[name.name] = variable;
+    return scopes.back()[name.name];
+}
@@ -0,0 +1,146 @@
+#ifndef __BYTECODE_H__
+#define __BYTECODE_H__
+
+#include <map>
+#include <vector>
+#include "ast.h"
+
+/*
+ *  Register bytecode, compiled straight from the AST for the interpreter.
+ *  Each function has its own register file, the arguments are registers
+ *  0..n-1 and a call passes the callee the registers starting at its first
+ *  argument, so arguments are never copied.
+ */
+
+enum Opcode {
+    BC_LOADI,       // a = int b
+    BC_LOADD,       // a = doubles[b]
+    BC_MOVE,        // a = b
+    BC_I2D,         // a = (double) b
+    BC_D2I,         // a = (int) b
+
+    BC_ADDI, BC_SUBI, BC_MULI, BC_DIVI,                         // a = b op c
+    BC_ADDD, BC_SUBD, BC_MULD, BC_DIVD,
+    BC_EQI, BC_NEI, BC_LTI, BC_LEI, BC_GTI, BC_GEI,             // a = b cmp c
+    BC_EQD, BC_NED, BC_LTD, BC_LED, BC_GTD, BC_GED,
+
+    BC_JMP,         // goto a
+    BC_JMPF,        // if !a goto b
+    BC_SWITCH,      // goto switches[b][a]
+    BC_CALL,        // a = functions[b]( c... )
+    BC_PRINTF,      // a = printf( printfs[b], c... )
+    BC_RET,         // return a
+    BC_RETV         // return
+};
+
+enum ValueType {
+    TYPE_VOID,
+    TYPE_INT,
+    TYPE_DOUBLE
+};
+
+union Slot {
+    int i;
+    double d;
+};
+
+struct BytecodeInstruction {
+    int op;
+    int a;
+    int b;
+    int c;
+};
+
+/* Jump targets of a switch: a table indexed by value - low when the
+   values are dense, else the sorted values searched in order */
+struct SwitchTable {
+    int low;
+    std::vector<int> dense;
+    std::vector<int> values;
+    std::vector<int> targets;
+    int defaultTarget;
+};
+
+struct PrintfSite {
+    String format;
+    std::vector<ValueType> argumentTypes;
+};
+
+/* Native code installed by the tier-up compiler, reads the arguments from
+   args and stores the result in result */
+typedef void (*NativeEntry)( Slot* args, Slot* result );
+
+class BytecodeFunction {
+public:
+    String name;
+    FunctionDeclaration* declaration;   // NULL for the top level statements
+    std::vector<ValueType> argumentTypes;
+    ValueType returnType;
+
+    std::vector<BytecodeInstruction> code;
+    std::vector<double> doubles;
+    std::vector<PrintfSite> printfs;
+    std::vector<SwitchTable> switches;
+    int registerCount;
+
+    std::vector<int> callees;
+    bool usesRuntime;                   // spawn, sync or memo, never tiered up
+
+    /* memoized pure function: its direct-mapped cache of valid, arguments
+       and result slots, allocated by the interpreter on the first call */
+    bool memoized;
+    std::vector<Slot> memo;
+
+    /* hotness counters and the tier-up result, the native entry is
+       written by the compile thread */
+    unsigned calls;
+    unsigned branches;
+    bool compileRequested;
+    NativeEntry native;
+
+    BytecodeFunction( const String& name, FunctionDeclaration* declaration ) :
+        name( name ), declaration( declaration ), returnType( TYPE_VOID ), registerCount( 0 ),
+        usesRuntime( false ), memoized( false ), calls( 0 ), branches( 0 ), compileRequested( false ), native( NULL ) { }
+};
+
+class BytecodeProgram {
+public:
+    /* functions[0] runs the top level statements */
+    std::vector<BytecodeFunction*> functions;
+};
+
+class BytecodeCompiler {
+public:
+    BytecodeProgram* compile(StatementBlock& root);
+
+private:
+    struct Variable {
+        int reg;
+        ValueType type;
+    };
+
+    BytecodeProgram* program;
+    BytecodeFunction* function;
+    std::map<String, int> functionIndex;
+    std::vector< std::map<String, Variable> > scopes;
+    int nextRegister;
+
+    void declareFunctions(StatementBlock& block);
+    void compileFunction(BytecodeFunction* function, StatementBlock& body, VariableList* arguments);
+    void compileBlock(StatementBlock& block);
+    void compileStatement(Statement* statement);
+    void compileSwitch(SwitchStatement* statement);
+    ValueType compileExpression(Expression* expression, int target);
+    int compileOperand(Expression* expression, ValueType& type);
+    int compileCall(const String& name, ExpressionList& arguments, int target, ValueType& type);
+    void convert(int reg, ValueType from, ValueType to);
+
+    int allocate();
+    int emit(int op, int a = 0, int b = 0, int c = 0);
+    Variable* lookup(const String& name);
+    Variable& declare(const Identifier& type, const Identifier& name);
+};
+
+ValueType valueTypeOf(const Identifier& type);
+
+#endif
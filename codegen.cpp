@@ -2,27 +2,35 @@
 #include "codegen.h"
 #include "log.h"
 #include "parser.hpp"
+#include "perfmap.h"
+#include "purity.h"
+#include "switchconversion.h"
 #include <iostream>
+#include <set>
 #include <typeinfo>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Dwarf.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Transforms/IPO.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 using namespace std;
 
 int PrintfMethodCall::instanceCount = 0;
 int BranchStatement::instanceCount = 0;
-
-static llvm::Function* getPutcharPrototype(llvm::LLVMContext& ctx, llvm::Module *mod)
-{
-    vector<Type*> argTypes;
-    //argTypes.push_back(Type::getInt32Ty(ctx));
-    FunctionType *ftype = FunctionType::get(Type::getVoidTy(getGlobalContext()), makeArrayRef(argTypes), false);
-    Function* func = Function::Create(ftype, GlobalValue::ExternalLinkage, "putchar", mod);
-    func->setCallingConv(llvm::CallingConv::C);
-    
-    return func;
-}
-
+int SpawnStatement::instanceCount = 0;
+int SwitchStatement::instanceCount = 0;
 
 static llvm::Function* getPrintfPrototype(llvm::LLVMContext& ctx, llvm::Module *mod)
 {
@@ -52,45 +60,530 @@ static llvm::Function* getPrintfPrototype(llvm::LLVMContext& ctx, llvm::Module *
     //*/
 }
 
-/* Compile the AST into a module */
-std::string CodeGenContext::generateCode(StatementBlock& root)
+/* void poulp_spawn(i32* group, void (i8*)* task, i8* frame), see runtime/poulprt.h */
+static llvm::Function* getSpawnPrototype(llvm::LLVMContext& ctx, llvm::Module *mod)
+{
+    std::vector<Type*> taskArgs;
+    taskArgs.push_back(Type::getInt8PtrTy(ctx));
+    FunctionType *taskType = FunctionType::get(Type::getVoidTy(ctx), taskArgs, false);
+
+    std::vector<Type*> argTypes;
+    argTypes.push_back(Type::getInt32PtrTy(ctx));
+    argTypes.push_back(PointerType::getUnqual(taskType));
+    argTypes.push_back(Type::getInt8PtrTy(ctx));
+    FunctionType *ftype = FunctionType::get(Type::getVoidTy(ctx), argTypes, false);
+
+    Function *func = Function::Create(ftype, GlobalValue::ExternalLinkage, "poulp_spawn", mod);
+    func->setCallingConv(llvm::CallingConv::C);
+    func->setDoesNotThrow();
+    return func;
+}
+
+/* void poulp_sync(i32* group) */
+static llvm::Function* getSyncPrototype(llvm::LLVMContext& ctx, llvm::Module *mod)
+{
+    std::vector<Type*> argTypes;
+    argTypes.push_back(Type::getInt32PtrTy(ctx));
+    FunctionType *ftype = FunctionType::get(Type::getVoidTy(ctx), argTypes, false);
+
+    Function *func = Function::Create(ftype, GlobalValue::ExternalLinkage, "poulp_sync", mod);
+    func->setCallingConv(llvm::CallingConv::C);
+    func->setDoesNotThrow();
+    func->setDoesNotCapture(1);
+    return func;
+}
+
+/* Returns the counter of the tasks spawned by function, created
+   on first use at the top of the entry block so it dominates every sync */
+Value* CodeGenContext::spawnGroup(Function *function)
+{
+    std::map<Function*, Value*>::iterator it = spawnGroups.find(function);
+    if( it != spawnGroups.end() ){
+        return it->second;
+    }
+
+    BasicBlock &entry = function->getEntryBlock();
+    IRBuilder<> builder(&entry, entry.begin());
+    Value *group = builder.CreateAlloca(Type::getInt32Ty(getGlobalContext()), 0, "spawn.group");
+    builder.CreateStore(ConstantInt::get(Type::getInt32Ty(getGlobalContext()), 0), group);
+
+    spawnGroups[function] = group;
+    return group;
+}
+
+/* Waits for the tasks spawned by the function of block, if it spawned any */
+void CodeGenContext::emitSync(BasicBlock *block)
+{
+    std::map<Function*, Value*>::iterator it = spawnGroups.find(block->getParent());
+    if( it == spawnGroups.end() ){
+        return;
+    }
+
+    if( syncFunction == NULL ){
+        syncFunction = getSyncPrototype( getGlobalContext(), module );
+    }
+    CallInst::Create(syncFunction, it->second, "", block);
+}
+
+/* Returns the function called name, or when it is not defined yet a
+   forward declaration typed after args and returning int */
+Function* CodeGenContext::calledFunction(const std::string& name, const std::vector<Value*>& args)
+{
+    Function *function = module->getFunction(name);
+    if( function != NULL ){
+        return function;
+    }
+
+    std::vector<Type*> argTypes;
+    std::vector<Value*>::const_iterator it;
+    for( it = args.begin(); it != args.end(); ++it ){
+        argTypes.push_back((*it)->getType());
+    }
+    FunctionType *ftype = FunctionType::get(Type::getInt32Ty(getGlobalContext()), argTypes, false);
+    function = Function::Create(ftype, GlobalValue::ExternalLinkage, name, module);
+    forwardDeclarations.insert(function);
+    Log::Debug() << "Forward declaration of " << name << "\n";
+    return function;
+}
+
+/* Converts between int and double, NULL for other types */
+static Value* convertValue(IRBuilder<>& builder, Value *value, Type *type)
+{
+    if( value->getType() == type ){
+        return value;
+    }
+    if( value->getType()->isIntegerTy() && type->isDoubleTy() ){
+        return builder.CreateSIToFP(value, type);
+    }
+    if( value->getType()->isDoubleTy() && type->isIntegerTy() ){
+        return builder.CreateFPToSI(value, type);
+    }
+    return NULL;
+}
+
+/* Creates the function name, taking the place of its forward declaration.
+   Calls made before with other types than the definition are rebuilt with
+   their arguments and result converted. The old calls stay in place,
+   unused, until removeReplacedCalls: one of them may be the last
+   instruction of a CodeGenPosition still waiting for its debug location */
+Function* CodeGenContext::defineFunction(const std::string& name, FunctionType *type, GlobalValue::LinkageTypes linkage)
+{
+    Function *forward = module->getFunction(name);
+    if( forward == NULL || forwardDeclarations.erase(forward) == 0 ){
+        return Function::Create(type, linkage, name, module);
+    }
+    if( forward->getFunctionType() == type ){
+        forward->setLinkage(linkage);
+        return forward;
+    }
+
+    Function *function = Function::Create(type, linkage, "", module);
+    function->takeName(forward);
+
+    std::vector<CallInst*> calls;
+    Value::use_iterator use;
+    for( use = forward->use_begin(); use != forward->use_end(); ++use ){
+        calls.push_back(cast<CallInst>(*use));
+    }
+    std::vector<CallInst*>::iterator it;
+    for( it = calls.begin(); it != calls.end(); ++it ){
+        CallInst *call = *it;
+        if( call->getNumArgOperands() != type->getNumParams() ){
+            std::cerr << "wrong number of arguments to " << name << endl;
+            exit( -1 );
+        }
+
+        IRBuilder<> builder(call);
+        builder.SetCurrentDebugLocation(call->getDebugLoc());
+        std::vector<Value*> args;
+        for( unsigned i = 0; i < call->getNumArgOperands(); ++i ){
+            Value *arg = convertValue(builder, call->getArgOperand(i), type->getParamType(i));
+            if( arg == NULL ){
+                std::cerr << "wrong type of argument " << i + 1 << " to " << name << endl;
+                exit( -1 );
+            }
+            args.push_back(arg);
+        }
+        CallInst *definitive = builder.CreateCall(function, args);
+
+        /* the caller was generated for an int result */
+        Value *result = Constant::getNullValue(call->getType());
+        if( !type->getReturnType()->isVoidTy() ){
+            BasicBlock::iterator next = definitive;
+            builder.SetInsertPoint(++next);
+            result = convertValue(builder, definitive, call->getType());
+        }
+        call->replaceAllUsesWith(result);
+    }
+    replacedDeclarations.push_back(forward);
+    return function;
+}
+
+/* Deletes the forward declarations replaced by defineFunction and their
+   old calls, once code generation is done */
+void CodeGenContext::removeReplacedCalls()
+{
+    std::vector<Function*>::iterator it;
+    for( it = replacedDeclarations.begin(); it != replacedDeclarations.end(); ++it ){
+        while( !(*it)->use_empty() ){
+            cast<Instruction>((*it)->use_back())->eraseFromParent();
+        }
+        (*it)->eraseFromParent();
+    }
+    replacedDeclarations.clear();
+}
+
+/* Resolve the target triple, cpu and features and store the triple and
+   data layout in the module, so the optimizer and llc know the real machine */
+#if defined(__i386__) || defined(__x86_64__)
+
+/* Whether the OS saves the register state selected by mask (XCR0) */
+static bool osSavesState(unsigned mask)
+{
+    unsigned eax, ebx, ecx, edx;
+    if( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) ){
+        return false;
+    }
+    unsigned xcr0, xcr0High;
+    __asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+    return (xcr0 & mask) == mask;
+}
+
+/* The host x86 features under their LLVM 3.4 names, read from cpuid:
+   sys::getHostCPUFeatures only knows ARM in 3.4 */
+static bool getX86HostFeatures(StringMap<bool>& features)
+{
+    unsigned eax, ebx, ecx, edx;
+    if( !__get_cpuid(1, &eax, &ebx, &ecx, &edx) ){
+        return false;
+    }
+    bool avxState = osSavesState(0x6);
+    bool avx512State = osSavesState(0xe6);
+
+    features["cmov"] = edx & (1 << 15);
+    features["mmx"] = edx & (1 << 23);
+    features["sse"] = edx & (1 << 25);
+    features["sse2"] = edx & (1 << 26);
+    features["sse3"] = ecx & (1 << 0);
+    features["pclmul"] = ecx & (1 << 1);
+    features["ssse3"] = ecx & (1 << 9);
+    features["fma"] = avxState && (ecx & (1 << 12));
+    features["cmpxchg16b"] = ecx & (1 << 13);
+    features["sse41"] = ecx & (1 << 19);
+    features["sse42"] = ecx & (1 << 20);
+    features["movbe"] = ecx & (1 << 22);
+    features["popcnt"] = ecx & (1 << 23);
+    features["aes"] = ecx & (1 << 25);
+    features["avx"] = avxState && (ecx & (1 << 28));
+    features["f16c"] = avxState && (ecx & (1 << 29));
+    features["rdrnd"] = ecx & (1 << 30);
+
+    unsigned maxLeaf = __get_cpuid_max(0, NULL);
+    if( maxLeaf >= 7 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ){
+        features["fsgsbase"] = ebx & (1 << 0);
+        features["bmi"] = ebx & (1 << 3);
+        features["hle"] = ebx & (1 << 4);
+        features["avx2"] = avxState && (ebx & (1 << 5));
+        features["bmi2"] = ebx & (1 << 8);
+        features["rtm"] = ebx & (1 << 11);
+        features["avx-512"] = avx512State && (ebx & (1 << 16));
+        features["rdseed"] = ebx & (1 << 18);
+        features["adx"] = ebx & (1 << 19);
+        features["pfi"] = avx512State && (ebx & (1 << 26));
+        features["eri"] = avx512State && (ebx & (1 << 27));
+        features["cdi"] = avx512State && (ebx & (1 << 28));
+        features["sha"] = ebx & (1 << 29);
+    }
+
+    if( __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) ){
+        features["lzcnt"] = ecx & (1 << 5);
+        features["sse4a"] = ecx & (1 << 6);
+        features["prfchw"] = ecx & (1 << 8);
+        features["xop"] = avxState && (ecx & (1 << 11));
+        features["fma4"] = avxState && (ecx & (1 << 16));
+    }
+    return true;
+}
+#else
+static bool getX86HostFeatures(StringMap<bool>& features)
+{
+    return false;
+}
+#endif
+
+bool CodeGenContext::setupTarget()
+{
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+
+    if( targetTriple.empty() ){
+        targetTriple = sys::getDefaultTargetTriple();
+    }
+    targetTriple = Triple::normalize(targetTriple);
+
+    if( targetCPU == "native" ){
+        targetCPU = sys::getHostCPUName();
+
+        /* LLVM 3.4 names cpus it does not know "generic" or after their
+           base architecture, the features then have to come from the host */
+        bool genericCPU = targetCPU == "generic" || targetCPU == "x86-64" || targetCPU == "i686";
+
+        StringMap<bool> hostFeatures;
+        if( sys::getHostCPUFeatures(hostFeatures) || getX86HostFeatures(hostFeatures) ){
+            /* host features first so an explicit -mattr still wins */
+            SubtargetFeatures features;
+            StringMap<bool>::const_iterator it;
+            for( it = hostFeatures.begin(); it != hostFeatures.end(); ++it ){
+                features.AddFeature(it->getKey(), it->getValue());
+            }
+            SubtargetFeatures explicitFeatures(targetFeatures);
+            std::vector<std::string>::const_iterator feature;
+            for( feature = explicitFeatures.getFeatures().begin(); feature != explicitFeatures.getFeatures().end(); ++feature ){
+                features.AddFeature(*feature);
+            }
+            targetFeatures = features.getString();
+            if( genericCPU ){
+                std::cerr << "warning: host cpu unknown to LLVM 3.4, tuning for '" << targetCPU
+                          << "' with the features reported by the host" << endl;
+            }
+        } else {
+            std::cerr << "warning: cannot detect the host cpu features, only those implied by '"
+                      << targetCPU << "' are used";
+            if( genericCPU ){
+                std::cerr << ": pass -mcpu or -mattr to enable sse4, avx and newer";
+            }
+            std::cerr << endl;
+        }
+    }
+
+    std::string error;
+    const Target *target = TargetRegistry::lookupTarget(targetTriple, error);
+    if( target == NULL ){
+        Log::Error() << "unknown target " << targetTriple << ": " << error << endl;
+        return false;
+    }
+
+    TargetOptions options;
+    targetMachine = target->createTargetMachine(targetTriple, targetCPU, targetFeatures, options);
+    if( targetMachine == NULL ){
+        Log::Error() << "cannot create target machine for " << targetTriple << endl;
+        return false;
+    }
+
+    module->setTargetTriple(targetTriple);
+    module->setDataLayout(targetMachine->getDataLayout()->getStringRepresentation());
+
+    Log::Debug() << "Target " << targetTriple << " cpu '" << targetCPU
+                 << "' features '" << targetFeatures << "'\n";
+    return true;
+}
+
+/* Tag a generated function with the selected cpu and its features */
+void CodeGenContext::setTargetAttributes(Function *function)
+{
+    if( !targetCPU.empty() ){
+        function->addFnAttr("target-cpu", targetCPU);
+    }
+    if( !targetFeatures.empty() ){
+        function->addFnAttr("target-features", targetFeatures);
+    }
+}
+
+/* Start the compile unit of the source file, with its absolute directory
+   so debuggers and perf find the source from anywhere */
+void CodeGenContext::beginDebugInfo()
+{
+    SmallString<128> path(sourceFile.empty() ? "<stdin>" : sourceFile);
+    sys::fs::make_absolute(path);
+    StringRef directory = sys::path::parent_path(path);
+    StringRef file = sys::path::filename(path);
+
+    debugBuilder = new DIBuilder(*module);
+    debugBuilder->createCompileUnit(dwarf::DW_LANG_C, file, directory, "lft-cc", false, "", 0);
+    debugFile = debugBuilder->createFile(file, directory);
+}
+
+void CodeGenContext::finishDebugInfo()
+{
+    debugBuilder->finalize();
+    module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    delete debugBuilder;
+    debugBuilder = NULL;
+}
+
+/* Describe function as a subprogram starting at line, the scope of the
+   locations of its instructions. Only line tables are emitted, there are
+   no variable descriptions to keep the optimizer from its work */
+void CodeGenContext::createDebugScope(Function *function, int line)
+{
+    if( !debugInfo ){
+        return;
+    }
+
+    DIArray parameters = debugBuilder->getOrCreateArray(ArrayRef<Value*>());
+    DICompositeType type = debugBuilder->createSubroutineType(debugFile, parameters);
+    DISubprogram subprogram = debugBuilder->createFunction(debugFile, function->getName(), StringRef(),
+                                                           debugFile, line, type, function->hasLocalLinkage(),
+                                                           true, line, DIDescriptor::FlagPrototyped, false, function);
+    debugScopes[function] = subprogram;
+}
+
+CodeGenPosition CodeGenContext::position()
+{
+    CodeGenPosition position;
+    position.block = currentBlock();
+    position.lastInstruction = position.block->empty() ? NULL : &position.block->back();
+    position.lastBlock = &position.block->getParent()->back();
+    return position;
+}
+
+/* Give line to the instructions added since from that have no location yet,
+   the ones of nested statements were already set by their own statement */
+void CodeGenContext::setDebugLocation(const CodeGenPosition& from, int line)
+{
+    if( !debugInfo ){
+        return;
+    }
+
+    Function *function = from.block->getParent();
+    std::map<Function*, MDNode*>::iterator scope = debugScopes.find(function);
+    if( scope == debugScopes.end() ){
+        return;
+    }
+    DebugLoc location = DebugLoc::get(line, 0, scope->second);
+
+    BasicBlock::iterator inst = from.block->begin();
+    if( from.lastInstruction != NULL ){
+        inst = from.lastInstruction;
+        ++inst;
+    }
+    for( ; inst != from.block->end(); ++inst ){
+        if( inst->getDebugLoc().isUnknown() ){
+            inst->setDebugLoc(location);
+        }
+    }
+
+    Function::iterator block = from.lastBlock;
+    for( ++block; block != function->end(); ++block ){
+        for( inst = block->begin(); inst != block->end(); ++inst ){
+            if( inst->getDebugLoc().isUnknown() ){
+                inst->setDebugLoc(location);
+            }
+        }
+    }
+}
+
+/* Give line to every instruction of function that has no location yet */
+void CodeGenContext::setDebugLocation(Function *function, int line)
+{
+    if( !debugInfo || function->empty() ){
+        return;
+    }
+
+    CodeGenPosition all;
+    all.block = &function->front();
+    all.lastInstruction = NULL;
+    all.lastBlock = all.block;
+    setDebugLocation(all, line);
+}
+
+/* Start main, the function running the top level statements */
+void CodeGenContext::beginCode()
 {
     Log::Debug() << "Generating code...\n";
 
+    if( debugInfo ){
+        beginDebugInfo();
+    }
+
     /* Create the top level interpreter function to call as entry */
     vector<Type*> argTypes;
     FunctionType *ftype = FunctionType::get(Type::getVoidTy(getGlobalContext()), makeArrayRef(argTypes), false);
     mainFunction = Function::Create(ftype, GlobalValue::ExternalLinkage, "main", module);
     mainFunction->setCallingConv(llvm::CallingConv::C);
+    setTargetAttributes(mainFunction);
     BasicBlock *bblock = BasicBlock::Create(getGlobalContext(), "entry", mainFunction, 0);
+    createDebugScope(mainFunction, 1);
 
     /* Push a new variable/block context */
     pushBlock(bblock);
+}
 
-    /* Create the printf function declaration */
-    printfFunction = getPrintfPrototype( getGlobalContext(), module );
+/* Generate one top level statement as soon as it is parsed, functions it
+   calls that are not defined yet get a forward declaration */
+void CodeGenContext::emitTopLevel(Statement& statement)
+{
+    CodeGenPosition from = position();
+    statement.codeGen(*this);
+    setDebugLocation(from, statement.line);
+}
 
-    /* Create the putchar function declaration */
-    getPutcharPrototype( getGlobalContext(), module );
-    
-    root.codeGen(*this); /* emit bytecode for the toplevel block */
+/* Close main and print the module as text to out */
+void CodeGenContext::finishCode(raw_ostream& out)
+{
+    std::set<Function*>::iterator forward;
+    for( forward = forwardDeclarations.begin(); forward != forwardDeclarations.end(); ++forward ){
+        std::cerr << "no such function " << (*forward)->getName().str() << endl;
+    }
+    if( !forwardDeclarations.empty() ){
+        exit( -1 );
+    }
 
     //ReturnInst::Create(getGlobalContext(), ConstantInt::get(Type::getInt32Ty(getGlobalContext()), 0), bblock);
-    ReturnInst::Create(getGlobalContext(), bblock);
+    emitSync(currentBlock());
+    ReturnInst::Create(getGlobalContext(), currentBlock());
     popBlock();
+    removeReplacedCalls();
+
+    if( debugInfo ){
+        setDebugLocation(mainFunction, lineNumber);
+        finishDebugInfo();
+    }
 
     /* Print the bytecode in a human-readable format
        to see if our program compiled properly
      */
     Log::Debug() << "Code is generated.\n";
 
-    std::string outputString;
-    raw_ostream* outputStream = new raw_string_ostream(outputString);
     PassManager pm;
-    pm.add(createPrintModulePass(outputStream));
+    if( wholeProgram ){
+        /* only main is visible: drop what it cannot reach, then infer
+           nounwind, readnone/readonly, nocapture and noalias bottom-up */
+        pm.add(createGlobalDCEPass());
+        pm.add(createPruneEHPass());
+        pm.add(createFunctionAttrsPass());
+    }
+    pm.add(createPrintModulePass(&out));
     pm.run(*module);
+}
+
+/* Compile the AST into a module printed to out */
+void CodeGenContext::generateCode(StatementBlock& root, raw_ostream& out)
+{
+    beginCode();
+
+    /* if/else chains on one variable become switch statements */
+    SwitchConversion switches;
+    switches.run(root);
+
+    /* Pure functions are marked readnone and can be memoized */
+    PurityAnalysis purity;
+    purity.analyze(root);
 
-    return outputString;
+    root.codeGen(*this); /* emit bytecode for the toplevel block */
+
+    finishCode(out);
+}
+
+/* Compile functions without a main, callees must come before their callers */
+void CodeGenContext::generateFunctions(std::vector<FunctionDeclaration*>& functions)
+{
+    std::vector<FunctionDeclaration*>::iterator it;
+    for (it = functions.begin(); it != functions.end(); it++) {
+        (**it).codeGen(*this);
+    }
+    removeReplacedCalls();
 }
 
 /* Executes the AST by running the main function */
@@ -104,7 +597,16 @@ GenericValue CodeGenContext::runCode() {
         Log::Error() << "Error: " << error << endl;
         return GenericValue();
     } else {
+        PerfMapListener *perfMap = NULL;
+        if( debugInfo ){
+            perfMap = new PerfMapListener();
+            ee->RegisterJITEventListener(perfMap);
+        }
         GenericValue v = ee->runFunction(mainFunction, noargs);
+        if( perfMap != NULL ){
+            ee->UnregisterJITEventListener(perfMap);
+            delete perfMap;
+        }
         Log::Debug() << "Code was run.\n";
         return v;
     }
@@ -171,17 +673,14 @@ Value* MethodCall::codeGen(CodeGenContext& context)
     return call;
     /*/
 
-    Function *function = context.module->getFunction(methodName.name.c_str());
-    if (function == NULL) {
-        std::cerr << "no such function " << methodName.name << endl;
-    }
     std::vector<Value*> args;
     ExpressionList::const_iterator it;
     for (it = arguments.begin(); it != arguments.end(); it++) {
         args.push_back((**it).codeGen(context));
     }
+    Function *function = context.calledFunction(methodName.name, args);
     CallInst *call = CallInst::Create(function, makeArrayRef(args), "", context.currentBlock());
-    std::cout << "Creating method call: " << methodName.name << endl;
+    Log::Debug() << "Creating method call: " << methodName.name << endl;
     return call;
     //*/
 }
@@ -189,16 +688,7 @@ Value* MethodCall::codeGen(CodeGenContext& context)
 Value* PrintfMethodCall::codeGen(CodeGenContext& context)
 {
     String name = getUniqueName();
-    String fmt = format.substr(1, format.size()-2);
-    
-    /* replace \n */
-    int i = 0;
-    while ( i < fmt.size()-1 ){
-        if( fmt[i] == '\\' && fmt[i+1] == 'n' ){
-            fmt.replace(i , i+1, "\13\15");
-        }
-        ++i;
-    }
+    String fmt = formatString();
     
     /* format string */
     //Constant *format_const = ConstantArray::get(getGlobalContext(), fmt.c_str());
@@ -225,6 +715,9 @@ Value* PrintfMethodCall::codeGen(CodeGenContext& context)
         args.push_back((**it).codeGen(context));
     }
 
+    if (context.printfFunction == NULL) {
+        context.printfFunction = getPrintfPrototype( getGlobalContext(), context.module );
+    }
     CallInst *call = CallInst::Create(context.printfFunction, makeArrayRef(args), "", context.currentBlock());
   //CallInst *call = CallInst::Create(function, args.begin(), args.end(), "", context.currentBlock());
 
@@ -285,7 +778,9 @@ Value* StatementBlock::codeGen(CodeGenContext& context)
     Value *last = NULL;
     for (it = statements.begin(); it != statements.end(); it++) {
     Log::Debug() << "Generating code for " << typeid(**it).name() << std::endl;
+        CodeGenPosition from = context.position();
         last = (**it).codeGen(context);
+        context.setDebugLocation(from, (**it).line);
     }
     Log::Debug() << "Creating block" << std::endl;
     return last;
@@ -309,18 +804,94 @@ Value* VariableDeclaration::codeGen(CodeGenContext& context)
     }
     return alloc;
     /*/
-    std::cout << "Creating variable declaration " << type.name << " " << name.name << endl;
+    Log::Debug() << "Creating variable declaration " << type.name << " " << name.name << endl;
     AllocaInst *alloc = new AllocaInst(typeOf(type), name.name.c_str(), context.currentBlock());
     context.locals()[name.name] = alloc;
     if (assignmentExpression != NULL) {
-        Assignment assn(name, assignmentExpression);
-        assn.codeGen(context);
+        new StoreInst(assignmentExpression->codeGen(context), alloc, false, context.currentBlock());
     }
 
     return alloc;
     //*/
 }
 
+/* Memoization cache: 2^MemoCacheBits direct-mapped entries per function,
+   thread local so tasks spawned on other workers never race on it */
+static const unsigned MemoCacheBits = 12;
+
+/* Generates wrapper as a lookup of its arguments in the cache of impl,
+   calling impl and filling the entry on a miss */
+static void emitMemoWrapper(CodeGenContext& context, Function *wrapper, Function *impl)
+{
+    LLVMContext &ctx = getGlobalContext();
+    Type *i8 = Type::getInt8Ty(ctx);
+    Type *i64 = Type::getInt64Ty(ctx);
+    String name = wrapper->getName().str();
+
+    /* cache entry: { i8 valid, arguments..., result } */
+    std::vector<Type*> fields;
+    fields.push_back(i8);
+    Function::arg_iterator arg;
+    for (arg = wrapper->arg_begin(); arg != wrapper->arg_end(); arg++) {
+        fields.push_back(arg->getType());
+    }
+    fields.push_back(wrapper->getReturnType());
+    StructType *entryType = StructType::create(ctx, fields, name + ".memo.entry");
+    ArrayType *cacheType = ArrayType::get(entryType, 1 << MemoCacheBits);
+    GlobalVariable *cache = new GlobalVariable(*context.module, cacheType, false,
+        GlobalValue::InternalLinkage, Constant::getNullValue(cacheType), name + ".memo",
+        0, GlobalVariable::GeneralDynamicTLSModel);
+
+    BasicBlock *entry = BasicBlock::Create(ctx, "entry", wrapper);
+    BasicBlock *hit = BasicBlock::Create(ctx, "hit", wrapper);
+    BasicBlock *miss = BasicBlock::Create(ctx, "miss", wrapper);
+    IRBuilder<> builder(entry);
+
+    /* fibonacci hashing of the argument bits, the top bits index the cache */
+    std::vector<Value*> args;
+    std::vector<Value*> keys;
+    Value *hash = ConstantInt::get(i64, 0);
+    Function::arg_iterator implArg = impl->arg_begin();
+    for (arg = wrapper->arg_begin(); arg != wrapper->arg_end(); arg++, implArg++) {
+        arg->setName(implArg->getName());
+        args.push_back(arg);
+
+        Value *bits = arg->getType()->isDoubleTy() ?
+            builder.CreateBitCast(arg, i64) : builder.CreateZExt(arg, i64);
+        keys.push_back(bits);
+        hash = builder.CreateMul(builder.CreateXor(hash, bits), ConstantInt::get(i64, 0x9E3779B97F4A7C15ULL));
+    }
+    Value *index = builder.CreateLShr(hash, 64 - MemoCacheBits);
+
+    Value *indices[] = { ConstantInt::get(i64, 0), index };
+    Value *slot = builder.CreateInBoundsGEP(cache, indices, "slot");
+
+    /* doubles are compared bitwise so 0.0 and -0.0 keep separate entries */
+    Value *match = builder.CreateICmpNE(builder.CreateLoad(builder.CreateStructGEP(slot, 0)), ConstantInt::get(i8, 0));
+    for (unsigned i = 0; i < args.size(); ++i) {
+        Value *stored = builder.CreateLoad(builder.CreateStructGEP(slot, i + 1));
+        if (stored->getType()->isDoubleTy()) {
+            stored = builder.CreateBitCast(stored, i64);
+        } else {
+            stored = builder.CreateZExt(stored, i64);
+        }
+        match = builder.CreateAnd(match, builder.CreateICmpEQ(stored, keys[i]));
+    }
+    builder.CreateCondBr(match, hit, miss);
+
+    builder.SetInsertPoint(hit);
+    builder.CreateRet(builder.CreateLoad(builder.CreateStructGEP(slot, args.size() + 1)));
+
+    builder.SetInsertPoint(miss);
+    Value *result = builder.CreateCall(impl, args);
+    builder.CreateStore(ConstantInt::get(i8, 1), builder.CreateStructGEP(slot, 0));
+    for (unsigned i = 0; i < args.size(); ++i) {
+        builder.CreateStore(args[i], builder.CreateStructGEP(slot, i + 1));
+    }
+    builder.CreateStore(result, builder.CreateStructGEP(slot, args.size() + 1));
+    builder.CreateRet(result);
+}
+
 Value* FunctionDeclaration::codeGen(CodeGenContext& context)
 {
     /*
@@ -358,8 +929,37 @@ Value* FunctionDeclaration::codeGen(CodeGenContext& context)
         argTypes.push_back(typeOf((**it).type));
     }
     FunctionType *ftype = FunctionType::get(typeOf(functionType), makeArrayRef(argTypes), false);
-    Function *function = Function::Create(ftype, GlobalValue::ExternalLinkage, functionName.name.c_str(), context.module);
+
+    /* a memoized function is called through a cache lookup wrapper
+       under its own name, the body goes to an internal name.impl */
+    Function *memoWrapper = NULL;
+    if (isMemoized) {
+        if (!isPure) {
+            Log::Error() << "memo ignored on impure function " << functionName.name << std::endl;
+        } else if (ftype->getReturnType()->isVoidTy()) {
+            Log::Error() << "memo ignored on void function " << functionName.name << std::endl;
+        } else {
+            memoWrapper = context.defineFunction(functionName.name, ftype, context.functionLinkage());
+            context.setTargetAttributes(memoWrapper);
+            memoWrapper->addFnAttr(Attribute::NoUnwind);
+        }
+    }
+
+    Function *function;
+    if (memoWrapper != NULL) {
+        function = Function::Create(ftype, GlobalValue::InternalLinkage, functionName.name + ".impl", context.module);
+    } else {
+        function = context.defineFunction(functionName.name, ftype, context.functionLinkage());
+    }
+    context.setTargetAttributes(function);
+    if (isReadNone) {
+        function->addFnAttr(Attribute::ReadNone);
+    }
+    if (isPure) {
+        function->addFnAttr(Attribute::NoUnwind);
+    }
     BasicBlock *bblock = BasicBlock::Create(getGlobalContext(), "entry", function, 0);
+    context.createDebugScope(function, line);
 
     context.pushBlock(bblock);
 
@@ -377,8 +977,28 @@ Value* FunctionDeclaration::codeGen(CodeGenContext& context)
     block.codeGen(context);
     //ReturnInst::Create(getGlobalContext(), context.getCurrentReturnValue(), bblock);
 
+    /* falling off the end returns zero */
+    BasicBlock *last = context.currentBlock();
+    if( last->getTerminator() == NULL ){
+        context.emitSync(last);
+        if( function->getReturnType()->isVoidTy() ){
+            ReturnInst::Create(getGlobalContext(), last);
+        } else {
+            ReturnInst::Create(getGlobalContext(), Constant::getNullValue(function->getReturnType()), last);
+        }
+    }
+
     context.popBlock();
-    std::cout << "Creating function: " << functionName.name << endl;
+    context.setDebugLocation(function, line);
+
+    if (memoWrapper != NULL) {
+        emitMemoWrapper(context, memoWrapper, function);
+        context.createDebugScope(memoWrapper, line);
+        context.setDebugLocation(memoWrapper, line);
+        function = memoWrapper;
+    }
+
+    Log::Debug() << "Creating function: " << functionName.name << endl;
     return function;
     //*/
 }
@@ -386,13 +1006,20 @@ Value* FunctionDeclaration::codeGen(CodeGenContext& context)
 Value* ReturnStatement::codeGen(CodeGenContext& context)
 {
     Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
-    return ReturnInst::Create(getGlobalContext(), value->codeGen(context), context.currentBlock());
+    context.emitSync(context.currentBlock());
+    Value *result = value->codeGen(context);
+    ReturnInst *ret = ReturnInst::Create(getGlobalContext(), result, context.currentBlock());
+
+    /* statements after the return go to an unreachable block */
+    Function *function = context.currentBlock()->getParent();
+    context.setCurrentBlock(BasicBlock::Create(getGlobalContext(), "afterreturn", function));
+    return ret;
 }
 
 Value* BranchStatement::codeGen(CodeGenContext& context)
 {
     //*
-    std::cout << "Generating code for " << typeid(this).name() << std::endl;
+    Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
     IRBuilder<> builder(context.currentBlock());
     Value* test = testExpression->codeGen( context );
     Function *TheFunction = builder.GetInsertBlock()->getParent();
@@ -402,19 +1029,31 @@ Value* BranchStatement::codeGen(CodeGenContext& context)
     if( hasFalseBranch ){
         bfalse = BasicBlock::Create(getGlobalContext(), getUniqueName(), TheFunction);
     }
+    BasicBlock *bmerge = BasicBlock::Create(getGlobalContext(), getUniqueName(), TheFunction);
 
-    builder.CreateCondBr(test, btrue, bfalse);
+    builder.CreateCondBr(test, btrue, hasFalseBranch ? bfalse : bmerge);
 
-    context.pushBlock(btrue);
+    /* branches see the enclosing variables and continue at bmerge */
+    context.pushBlock(btrue, true);
     blockTrue.codeGen(context);
+    BasicBlock *endTrue = context.currentBlock();
     context.popBlock();
+    if( endTrue->getTerminator() == NULL ){
+        BranchInst::Create(bmerge, endTrue);
+    }
  
     if( hasFalseBranch ){   
-        context.pushBlock(bfalse);
+        context.pushBlock(bfalse, true);
         blockFalse.codeGen(context);
+        BasicBlock *endFalse = context.currentBlock();
         context.popBlock();
+        if( endFalse->getTerminator() == NULL ){
+            BranchInst::Create(bmerge, endFalse);
+        }
     }
-    std::cout << "Generated. " << std::endl;
+
+    context.setCurrentBlock(bmerge);
+    Log::Debug() << "Generated. " << std::endl;
     return NULL;
     /*/
     Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
@@ -442,3 +1081,175 @@ Value* BranchStatement::codeGen(CodeGenContext& context)
     return NULL;
     //*/
 }
+
+/* Emits an LLVM switch, which the backend lowers to a jump table or a
+   binary search depending on how dense the cases are */
+Value* SwitchStatement::codeGen(CodeGenContext& context)
+{
+    Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
+    LLVMContext &ctx = getGlobalContext();
+
+    Value *test = testExpression->codeGen( context );
+    if (test->getType() != Type::getInt32Ty(ctx)) {
+        std::cerr << "switch needs an int value" << std::endl;
+        exit( -1 );
+        return NULL;
+    }
+
+    Function *function = context.currentBlock()->getParent();
+    String name = getUniqueName();
+    BasicBlock *bend = BasicBlock::Create(ctx, name + ".end", function);
+    BasicBlock *bdefault = bend;
+
+    SwitchCaseList::const_iterator it;
+    for (it = cases.begin(); it != cases.end(); it++) {
+        if ((*it)->isDefault) {
+            if (bdefault != bend) {
+                std::cerr << "more than one default case" << std::endl;
+                exit( -1 );
+                return NULL;
+            }
+            bdefault = BasicBlock::Create(ctx, name + ".default", function);
+        }
+    }
+    SwitchInst *inst = SwitchInst::Create(test, bdefault, cases.size(), context.currentBlock());
+
+    std::set<int> values;
+    for (it = cases.begin(); it != cases.end(); it++) {
+        BasicBlock *bcase = bdefault;
+        if (!(*it)->isDefault) {
+            if (!values.insert((*it)->value).second) {
+                std::cerr << "duplicate case " << (*it)->value << std::endl;
+                exit( -1 );
+                return NULL;
+            }
+            bcase = BasicBlock::Create(ctx, name + ".case", function);
+            inst->addCase(ConstantInt::get(Type::getInt32Ty(ctx), (*it)->value, true), bcase);
+        }
+
+        /* cases see the enclosing variables and continue at the end */
+        context.pushBlock(bcase, true);
+        (*it)->block.codeGen(context);
+        BasicBlock *last = context.currentBlock();
+        context.popBlock();
+        if (last->getTerminator() == NULL) {
+            BranchInst::Create(bend, last);
+        }
+    }
+
+    context.setCurrentBlock(bend);
+    return inst;
+}
+
+/* Runs call on the work-stealing runtime. The arguments are evaluated now
+   and stored in a frame on the stack, together with the address of the
+   target variable; a generated task function unpacks them, makes the call
+   and stores the result. The target is only valid after the next sync. */
+Value* SpawnStatement::codeGen(CodeGenContext& context)
+{
+    Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
+    LLVMContext &ctx = getGlobalContext();
+
+    /* the frame layout needs the real types, no forward declaration here */
+    Function *callee = context.module->getFunction(call.methodName.name.c_str());
+    if (callee == NULL || context.forwardDeclarations.count(callee)) {
+        std::cerr << "spawn of " << call.methodName.name << " before its declaration" << endl;
+        exit( -1 );
+        return NULL;
+    }
+    if (callee->arg_size() != call.arguments.size()) {
+        std::cerr << "wrong number of arguments to " << call.methodName.name << endl;
+        exit( -1 );
+        return NULL;
+    }
+
+    Value *targetVariable = NULL;
+    if (target != NULL) {
+        if (context.locals().find(target->name) == context.locals().end()) {
+            std::cerr << "undeclared variable " << target->name << std::endl;
+            exit( -1 );
+            return NULL;
+        }
+        targetVariable = context.locals()[target->name];
+        if (callee->getReturnType()->isVoidTy()) {
+            std::cerr << "void function " << call.methodName.name << " has no result for " << target->name << endl;
+            exit( -1 );
+            return NULL;
+        }
+    }
+    bool hasResult = targetVariable != NULL;
+
+    String name = getUniqueName();
+
+    /* frame: { arguments..., result* } */
+    std::vector<Type*> fields;
+    Function::arg_iterator arg;
+    for (arg = callee->arg_begin(); arg != callee->arg_end(); arg++) {
+        fields.push_back(arg->getType());
+    }
+    if (hasResult) {
+        fields.push_back(targetVariable->getType());
+    }
+    StructType *frameType = StructType::create(ctx, fields, name + ".frame");
+
+    /* task function: void spawnN(i8* frame) */
+    std::vector<Type*> taskArgs;
+    taskArgs.push_back(Type::getInt8PtrTy(ctx));
+    FunctionType *taskType = FunctionType::get(Type::getVoidTy(ctx), taskArgs, false);
+    Function *task = Function::Create(taskType, GlobalValue::InternalLinkage, name, context.module);
+    context.setTargetAttributes(task);
+    context.createDebugScope(task, line);
+    /* the frame belongs to this task until the spawner syncs */
+    task->setDoesNotAlias(1);
+    task->setDoesNotCapture(1);
+
+    IRBuilder<> taskBuilder(BasicBlock::Create(ctx, "entry", task));
+    Value *taskFrame = taskBuilder.CreateBitCast(task->arg_begin(), PointerType::getUnqual(frameType));
+    std::vector<Value*> args;
+    for (unsigned i = 0; i < call.arguments.size(); ++i) {
+        args.push_back(taskBuilder.CreateLoad(taskBuilder.CreateStructGEP(taskFrame, i)));
+    }
+    Value *result = taskBuilder.CreateCall(callee, args);
+    if (hasResult) {
+        /* an int result goes to a double target and back */
+        Type *targetType = cast<PointerType>(targetVariable->getType())->getElementType();
+        result = convertValue(taskBuilder, result, targetType);
+        if (result == NULL) {
+            std::cerr << "cannot store the result of " << call.methodName.name << " in " << target->name << endl;
+            exit( -1 );
+            return NULL;
+        }
+        taskBuilder.CreateStore(result, taskBuilder.CreateLoad(taskBuilder.CreateStructGEP(taskFrame, args.size())));
+    }
+    taskBuilder.CreateRetVoid();
+    /* the task body is the spawned call, it belongs to the spawn's line */
+    context.setDebugLocation(task, line);
+
+    /* fill the frame and queue the task */
+    IRBuilder<> builder(context.currentBlock());
+    Value *frame = builder.CreateAlloca(frameType, 0, name + ".frame");
+    for (unsigned i = 0; i < call.arguments.size(); ++i) {
+        Value *value = call.arguments[i]->codeGen(context);
+        builder.CreateStore(value, builder.CreateStructGEP(frame, i));
+    }
+    if (hasResult) {
+        builder.CreateStore(targetVariable, builder.CreateStructGEP(frame, call.arguments.size()));
+    }
+
+    if (context.spawnFunction == NULL) {
+        context.spawnFunction = getSpawnPrototype( ctx, context.module );
+    }
+    Function *function = context.currentBlock()->getParent();
+    std::vector<Value*> spawnArgs;
+    spawnArgs.push_back(context.spawnGroup(function));
+    spawnArgs.push_back(task);
+    spawnArgs.push_back(builder.CreateBitCast(frame, Type::getInt8PtrTy(ctx)));
+    return builder.CreateCall(context.spawnFunction, spawnArgs);
+}
+
+Value* SyncStatement::codeGen(CodeGenContext& context)
+{
+    Log::Debug() << "Generating code for " << typeid(this).name() << std::endl;
+    context.emitSync(context.currentBlock());
+    return NULL;
+}
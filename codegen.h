@@ -1,6 +1,7 @@
 #ifndef __CODEGEN_H__
 #define __CODEGEN_H__
 
+#include <set>
 #include <stack>
 #include <typeinfo>
 #include <llvm/IR/Module.h>
@@ -20,10 +21,24 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/DIBuilder.h>
+#include <llvm/DebugInfo.h>
 
 using namespace llvm;
 
+class Statement;
 class StatementBlock;
+class FunctionDeclaration;
+
+/* Where code generation stood before a statement: the last instruction
+   of the current block and the last block of its function, NULL if empty */
+class CodeGenPosition {
+public:
+    BasicBlock *block;
+    llvm::Instruction *lastInstruction;
+    BasicBlock *lastBlock;
+};
 
 class CodeGenBlock {
 public:
@@ -39,15 +54,75 @@ public:
     Function *printfFunction;
     Function *currentFunction;
     Function *mainFunction;
-    CodeGenContext() { module = new Module("main", getGlobalContext()); }
+    CodeGenContext() : printfFunction(0), wholeProgram(false), targetMachine(0), spawnFunction(0), syncFunction(0),
+                       debugInfo(false), debugBuilder(0) { module = new Module("main", getGlobalContext()); }
     
     std::map<std::string, Value*> functionArguments;
 
-    std::string generateCode(StatementBlock& root);
+    /* Whole program mode: main is the only entry, the other functions
+       are internal and the unreachable ones are dropped */
+    bool wholeProgram;
+    GlobalValue::LinkageTypes functionLinkage() { return wholeProgram ? GlobalValue::InternalLinkage : GlobalValue::ExternalLinkage; }
+
+    /* Target selection, empty means host triple / generic cpu.
+       A cpu of "native" is resolved to the host cpu and its features */
+    std::string targetTriple;
+    std::string targetCPU;
+    std::string targetFeatures;
+    TargetMachine *targetMachine;
+
+    bool setupTarget();
+    void setTargetAttributes(Function *function);
+
+    /* spawn/sync runtime, declared on first use */
+    Function *spawnFunction;
+    Function *syncFunction;
+    std::map<Function*, Value*> spawnGroups;
+
+    Value* spawnGroup(Function *function);
+    void emitSync(BasicBlock *block);
+
+    /* Line table debug info (-g), every instruction gets the line of the
+       innermost statement that generated it */
+    bool debugInfo;
+    std::string sourceFile;
+    DIBuilder *debugBuilder;
+    DIFile debugFile;
+    std::map<Function*, MDNode*> debugScopes;
+
+    void beginDebugInfo();
+    void finishDebugInfo();
+    void createDebugScope(Function *function, int line);
+    CodeGenPosition position();
+    void setDebugLocation(const CodeGenPosition& from, int line);
+    void setDebugLocation(Function *function, int line);
+
+    /* Functions called before their definition, typed after the call, and
+       the ones whose definition had other types, removed at the end */
+    std::set<Function*> forwardDeclarations;
+    std::vector<Function*> replacedDeclarations;
+
+    Function* calledFunction(const std::string& name, const std::vector<Value*>& args);
+    Function* defineFunction(const std::string& name, FunctionType *type, GlobalValue::LinkageTypes linkage);
+    void removeReplacedCalls();
+
+    /* generateCode is beginCode, the statements and finishCode, streaming
+       compilation calls emitTopLevel for each statement as it is parsed */
+    void beginCode();
+    void emitTopLevel(Statement& statement);
+    void finishCode(raw_ostream& out);
+    void generateCode(StatementBlock& root, raw_ostream& out);
+    void generateFunctions(std::vector<FunctionDeclaration*>& functions);
     GenericValue runCode();
     std::map<std::string, Value*>& locals() { return blocks.top()->locals; }
     BasicBlock *currentBlock() { return blocks.top()->block; }
-    void pushBlock(BasicBlock *block) { blocks.push(new CodeGenBlock()); blocks.top()->block = block; }
+    void setCurrentBlock(BasicBlock *block) { blocks.top()->block = block; }
+    void pushBlock(BasicBlock *block, bool inheritLocals = false) {
+        CodeGenBlock *top = new CodeGenBlock();
+        top->block = block;
+        if (inheritLocals && !blocks.empty()) top->locals = blocks.top()->locals;
+        blocks.push(top);
+    }
     void popBlock() { CodeGenBlock *top = blocks.top(); blocks.pop(); delete top; }
 };
 
@@ -0,0 +1,484 @@
+#include "interpreter.h"
+#include "log.h"
+#include "purity.h"
+#include "switchconversion.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+
+using namespace std;
+
+/* register stack shared by all interpreted frames */
+static const size_t StackSlots = 1 << 20;
+
+/* calls plus conditional branches before a function is compiled */
+static const unsigned DefaultHotnessThreshold = 1000;
+
+/* memo cache entries per function, 2^MemoCacheBits like the generated code */
+static const unsigned MemoCacheBits = 12;
+
+Interpreter::Interpreter( CodeGenContext& target ) :
+    tierUp( true ), hotnessThreshold( DefaultHotnessThreshold ), target( target ), program( NULL ),
+    compileThreadStarted( false ), stopping( false ), engine( NULL ), perfMap( NULL )
+{
+    stack = new Slot[StackSlots];
+    stackEnd = stack + StackSlots;
+    pthread_mutex_init( &queueLock, NULL );
+    pthread_cond_init( &queueCondition, NULL );
+}
+
+/* Waits for the function being compiled, if any, and drops the queue */
+Interpreter::~Interpreter()
+{
+    pthread_mutex_lock( &queueLock );
+    stopping = true;
+    pthread_cond_broadcast( &queueCondition );
+    pthread_mutex_unlock( &queueLock );
+
+    if( compileThreadStarted ){
+        pthread_join( compileThread, NULL );
+    }
+    if( engine != NULL && perfMap != NULL ){
+        engine->UnregisterJITEventListener( perfMap );
+    }
+    delete perfMap;
+    delete[] stack;
+}
+
+void Interpreter::run(StatementBlock& root)
+{
+    SwitchConversion switches;
+    switches.run(root);
+
+    PurityAnalysis purity;
+    purity.analyze(root);
+
+    BytecodeCompiler compiler;
+    program = compiler.compile(root);
+
+    Log::Debug() << "Running bytecode...\n";
+    execute(program->functions[0], stack);
+    fflush(stdout);
+    Log::Debug() << "Bytecode was run.\n";
+}
+
+/* Bits of an argument as the generated memo wrapper keys it: ints zero
+   extended, doubles bitwise so 0.0 and -0.0 keep separate entries */
+static uint64_t memoKey(Slot value, ValueType type)
+{
+    if( type == TYPE_DOUBLE ){
+        uint64_t bits;
+        memcpy( &bits, &value.d, sizeof(bits) );
+        return bits;
+    }
+    return (uint32_t)value.i;
+}
+
+/* Cache entry for args, found by the same fibonacci hashing as the
+   generated wrapper: slot 0 is the valid flag, then the argument keys
+   and the result */
+static Slot* memoEntry(BytecodeFunction* function, Slot* args)
+{
+    size_t count = function->argumentTypes.size();
+    if( function->memo.empty() ){
+        Slot empty;
+        memset( &empty, 0, sizeof(empty) );
+        function->memo.resize( (count + 2) << MemoCacheBits, empty );
+    }
+
+    uint64_t hash = 0;
+    for( size_t i = 0; i < count; ++i ){
+        hash = (hash ^ memoKey(args[i], function->argumentTypes[i])) * 0x9E3779B97F4A7C15ULL;
+    }
+    return &function->memo[(hash >> (64 - MemoCacheBits)) * (count + 2)];
+}
+
+Slot Interpreter::call(BytecodeFunction* function, Slot* args)
+{
+    if( function->memoized ){
+        return callMemoized(function, args);
+    }
+
+    NativeEntry native = __atomic_load_n( &function->native, __ATOMIC_ACQUIRE );
+    if( native != NULL ){
+        Slot result;
+        native( args, &result );
+        return result;
+    }
+
+    ++function->calls;
+    if( tierUp && !function->compileRequested && function->calls + function->branches >= hotnessThreshold ){
+        requestCompile(function);
+    }
+    return execute(function, args);
+}
+
+/* Memoized functions stay interpreted, calls to them go through a cache
+   of their own instead of the thread local one of the generated code */
+Slot Interpreter::callMemoized(BytecodeFunction* function, Slot* args)
+{
+    size_t count = function->argumentTypes.size();
+    Slot* entry = memoEntry(function, args);
+
+    bool hit = entry[0].i != 0;
+    for( size_t i = 0; hit && i < count; ++i ){
+        hit = memoKey(entry[i + 1], TYPE_DOUBLE) == memoKey(args[i], function->argumentTypes[i]);
+    }
+    if( hit ){
+        return entry[count + 1];
+    }
+
+    /* the callee may assign its arguments, keep the key */
+    vector<uint64_t> key( count );
+    for( size_t i = 0; i < count; ++i ){
+        key[i] = memoKey(args[i], function->argumentTypes[i]);
+    }
+
+    ++function->calls;
+    Slot result = execute(function, args);
+
+    /* recursive calls may have refilled the entry since the lookup */
+    entry[0].i = 1;
+    for( size_t i = 0; i < count; ++i ){
+        memcpy( &entry[i + 1].d, &key[i], sizeof(key[i]) );
+    }
+    entry[count + 1] = result;
+    return result;
+}
+
+Slot Interpreter::execute(BytecodeFunction* function, Slot* frame)
+{
+    if( frame + function->registerCount > stackEnd ){
+        Log::Error() << "stack overflow in " << function->name << endl;
+        exit( -1 );
+    }
+
+    const BytecodeInstruction* code = &function->code[0];
+    const BytecodeInstruction* pc = code;
+
+    for( ;; ){
+        const BytecodeInstruction& in = *pc++;
+        Slot* r = frame;
+
+        switch( in.op ){
+        case BC_LOADI:  r[in.a].i = in.b; break;
+        case BC_LOADD:  r[in.a].d = function->doubles[in.b]; break;
+        case BC_MOVE:   r[in.a] = r[in.b]; break;
+        case BC_I2D:    r[in.a].d = r[in.b].i; break;
+        case BC_D2I:    r[in.a].i = (int)r[in.b].d; break;
+
+        /* int arithmetic wraps like the native code */
+        case BC_ADDI:   r[in.a].i = (int)((unsigned)r[in.b].i + (unsigned)r[in.c].i); break;
+        case BC_SUBI:   r[in.a].i = (int)((unsigned)r[in.b].i - (unsigned)r[in.c].i); break;
+        case BC_MULI:   r[in.a].i = (int)((unsigned)r[in.b].i * (unsigned)r[in.c].i); break;
+        case BC_DIVI:   r[in.a].i = r[in.b].i / r[in.c].i; break;
+        case BC_ADDD:   r[in.a].d = r[in.b].d + r[in.c].d; break;
+        case BC_SUBD:   r[in.a].d = r[in.b].d - r[in.c].d; break;
+        case BC_MULD:   r[in.a].d = r[in.b].d * r[in.c].d; break;
+        case BC_DIVD:   r[in.a].d = r[in.b].d / r[in.c].d; break;
+
+        case BC_EQI:    r[in.a].i = r[in.b].i == r[in.c].i; break;
+        case BC_NEI:    r[in.a].i = r[in.b].i != r[in.c].i; break;
+        case BC_LTI:    r[in.a].i = r[in.b].i <  r[in.c].i; break;
+        case BC_LEI:    r[in.a].i = r[in.b].i <= r[in.c].i; break;
+        case BC_GTI:    r[in.a].i = r[in.b].i >  r[in.c].i; break;
+        case BC_GEI:    r[in.a].i = r[in.b].i >= r[in.c].i; break;
+        case BC_EQD:    r[in.a].i = r[in.b].d == r[in.c].d; break;
+        case BC_NED:    r[in.a].i = r[in.b].d != r[in.c].d; break;
+        case BC_LTD:    r[in.a].i = r[in.b].d <  r[in.c].d; break;
+        case BC_LED:    r[in.a].i = r[in.b].d <= r[in.c].d; break;
+        case BC_GTD:    r[in.a].i = r[in.b].d >  r[in.c].d; break;
+        case BC_GED:    r[in.a].i = r[in.b].d >= r[in.c].d; break;
+
+        case BC_JMP:
+            pc = code + in.a;
+            break;
+        case BC_JMPF:
+            ++function->branches;
+            if( !r[in.a].i ){
+                pc = code + in.b;
+            }
+            break;
+
+        case BC_SWITCH: {
+            const SwitchTable& table = function->switches[in.b];
+            int value = r[in.a].i;
+            int target = table.defaultTarget;
+            ++function->branches;
+
+            if( !table.dense.empty() ){
+                unsigned long long index = (long long)value - table.low;
+                if( index < table.dense.size() ){
+                    target = table.dense[index];
+                }
+            } else {
+                vector<int>::const_iterator it = lower_bound(table.values.begin(), table.values.end(), value);
+                if( it != table.values.end() && *it == value ){
+                    target = table.targets[it - table.values.begin()];
+                }
+            }
+            pc = code + target;
+            break;
+        }
+
+        case BC_CALL: {
+            BytecodeFunction* callee = program->functions[in.b];
+            Slot result = call(callee, r + in.c);
+            if( callee->returnType != TYPE_VOID ){
+                r[in.a] = result;
+            }
+            break;
+        }
+        case BC_PRINTF:
+            r[in.a].i = print(function->printfs[in.b], r + in.c);
+            break;
+
+        case BC_RET:
+            return r[in.a];
+        case BC_RETV: {
+            Slot none;
+            none.d = 0;
+            return none;
+        }
+
+        default:
+            Log::Error() << "bad opcode " << in.op << " in " << function->name << endl;
+            exit( -1 );
+        }
+    }
+}
+
+/* printf with the argument types only known at run time: every conversion
+   is printed on its own, converting the argument to what it expects */
+int Interpreter::print(const PrintfSite& site, Slot* args)
+{
+    const String& format = site.format;
+    size_t next = 0;
+    int written = 0;
+
+    size_t i = 0;
+    while( i < format.size() ){
+        if( format[i] != '%' ){
+            putchar( format[i++] );
+            ++written;
+            continue;
+        }
+
+        size_t end = i + 1;
+        while( end < format.size() && strchr( "-+ #0123456789.hlLqjzt", format[end] ) ){
+            ++end;
+        }
+        if( end == format.size() ){
+            written += printf( "%s", format.c_str() + i );
+            break;
+        }
+
+        /* the length modifiers are dropped, arguments are int or double */
+        String spec;
+        for( size_t k = i; k < end; ++k ){
+            if( !strchr( "hlLqjzt", format[k] ) ){
+                spec += format[k];
+            }
+        }
+        char conversion = format[end];
+        spec += conversion;
+
+        if( conversion == '%' ){
+            putchar( '%' );
+            ++written;
+        } else if( next < site.argumentTypes.size() && strchr( "diouxXc", conversion ) ){
+            Slot value = args[next];
+            written += printf( spec.c_str(), site.argumentTypes[next] == TYPE_DOUBLE ? (int)value.d : value.i );
+            ++next;
+        } else if( next < site.argumentTypes.size() && strchr( "eEfFgGaA", conversion ) ){
+            Slot value = args[next];
+            written += printf( spec.c_str(), site.argumentTypes[next] == TYPE_DOUBLE ? value.d : (double)value.i );
+            ++next;
+        } else {
+            written += printf( "%s", format.substr( i, end - i + 1 ).c_str() );
+        }
+
+        i = end + 1;
+    }
+
+    return written;
+}
+
+/* -- Tier-up -- */
+
+void Interpreter::requestCompile(BytecodeFunction* function)
+{
+    function->compileRequested = true;
+
+    pthread_mutex_lock( &queueLock );
+    if( !compileThreadStarted ){
+        compileThreadStarted = pthread_create( &compileThread, NULL, compileLoop, this ) == 0;
+    }
+    compileQueue.push_back( function );
+    pthread_cond_signal( &queueCondition );
+    pthread_mutex_unlock( &queueLock );
+}
+
+void* Interpreter::compileLoop(void* arg)
+{
+    Interpreter* self = (Interpreter*)arg;
+
+    for( ;; ){
+        pthread_mutex_lock( &self->queueLock );
+        while( self->compileQueue.empty() && !self->stopping ){
+            pthread_cond_wait( &self->queueCondition, &self->queueLock );
+        }
+        if( self->stopping ){
+            pthread_mutex_unlock( &self->queueLock );
+            return NULL;
+        }
+        BytecodeFunction* function = self->compileQueue.front();
+        self->compileQueue.pop_front();
+        pthread_mutex_unlock( &self->queueLock );
+
+        self->compileNative( function );
+    }
+}
+
+/* Orders function after everything it calls. The code generator needs
+   callees first, so besides self recursion call cycles stay interpreted,
+   as do spawn, sync and memo which need the native runtime */
+bool Interpreter::collectCallees(BytecodeFunction* function, std::map<BytecodeFunction*, int>& state,
+                                 std::vector<BytecodeFunction*>& order)
+{
+    if( function->usesRuntime || function->declaration == NULL ){
+        return false;
+    }
+
+    state[function] = 1;
+    vector<int>::iterator it;
+    for( it = function->callees.begin(); it != function->callees.end(); ++it ){
+        BytecodeFunction* callee = program->functions[*it];
+        if( callee == function || state[callee] == 2 ){
+            continue;
+        }
+        if( state[callee] == 1 || !collectCallees(callee, state, order) ){
+            return false;
+        }
+    }
+    state[function] = 2;
+
+    order.push_back(function);
+    return true;
+}
+
+/* void name.entry(i64* args, i64* result), unpacks the interpreter slots */
+static Function* emitNativeEntry(Module *module, Function *function)
+{
+    LLVMContext &ctx = getGlobalContext();
+    std::vector<Type*> argTypes(2, Type::getInt64PtrTy(ctx));
+    FunctionType *ftype = FunctionType::get(Type::getVoidTy(ctx), argTypes, false);
+    Function *entry = Function::Create(ftype, GlobalValue::ExternalLinkage, function->getName() + ".entry", module);
+
+    Function::arg_iterator params = entry->arg_begin();
+    Value *args = params++;
+    Value *result = params;
+
+    IRBuilder<> builder(BasicBlock::Create(ctx, "entry", entry));
+    std::vector<Value*> values;
+    unsigned i = 0;
+    Function::arg_iterator arg;
+    for( arg = function->arg_begin(); arg != function->arg_end(); ++arg, ++i ){
+        Value *slot = builder.CreateConstGEP1_32(args, i);
+        values.push_back(builder.CreateLoad(builder.CreateBitCast(slot, PointerType::getUnqual(arg->getType()))));
+    }
+
+    Value *value = builder.CreateCall(function, values);
+    if( !function->getReturnType()->isVoidTy() ){
+        builder.CreateStore(value, builder.CreateBitCast(result, PointerType::getUnqual(function->getReturnType())));
+    }
+    builder.CreateRetVoid();
+    return entry;
+}
+
+void Interpreter::compileNative(BytecodeFunction* function)
+{
+    std::map<BytecodeFunction*, int> state;
+    std::vector<BytecodeFunction*> order;
+    if( !collectCallees(function, state, order) ){
+        Log::Debug() << "Tier-up: " << function->name << " stays interpreted\n";
+        return;
+    }
+    Log::Debug() << "Tier-up: compiling " << function->name << "\n";
+
+    /* the native code runs here, the cpu only applies to the host triple */
+    CodeGenContext codegen;
+    if( target.targetTriple == Triple::normalize(sys::getDefaultTargetTriple()) ){
+        codegen.targetCPU = target.targetCPU;
+        codegen.targetFeatures = target.targetFeatures;
+    }
+    if( !codegen.setupTarget() ){
+        delete codegen.module;
+        return;
+    }
+
+    std::vector<FunctionDeclaration*> declarations;
+    std::vector<BytecodeFunction*>::iterator it;
+    for( it = order.begin(); it != order.end(); ++it ){
+        declarations.push_back((*it)->declaration);
+    }
+    codegen.generateFunctions(declarations);
+
+    Module *module = codegen.module;
+    Function *entry = emitNativeEntry(module, module->getFunction(function->name));
+
+    /* only the entry is called from outside, the rest may be inlined */
+    Module::iterator f;
+    for( f = module->begin(); f != module->end(); ++f ){
+        if( !f->isDeclaration() && &*f != entry ){
+            f->setLinkage(GlobalValue::InternalLinkage);
+        }
+    }
+
+    std::string error;
+    if( verifyModule(*module, ReturnStatusAction, &error) ){
+        Log::Debug() << "Tier-up: " << function->name << " stays interpreted: " << error << "\n";
+        delete module;
+        return;
+    }
+
+    PassManager pm;
+    PassManagerBuilder builder;
+    builder.OptLevel = 2;
+    builder.Inliner = createFunctionInliningPass();
+    builder.populateModulePassManager(pm);
+    pm.run(*module);
+
+    if( engine == NULL ){
+        engine = EngineBuilder(module)
+                    .setEngineKind(EngineKind::JIT)
+                    .setErrorStr(&error)
+                    .setOptLevel(CodeGenOpt::Default)
+                    .setMCPU(codegen.targetCPU)
+                    .setMAttrs(SubtargetFeatures(codegen.targetFeatures).getFeatures())
+                    .create();
+        if( engine == NULL ){
+            Log::Error() << "cannot create JIT: " << error << endl;
+            delete module;
+            return;
+        }
+        engine->DisableLazyCompilation(true);
+        if( target.debugInfo ){
+            perfMap = new PerfMapListener();
+            engine->RegisterJITEventListener(perfMap);
+        }
+    } else {
+        engine->addModule(module);
+    }
+
+    NativeEntry native = (NativeEntry)engine->getPointerToFunction(entry);
+    __atomic_store_n( &function->native, native, __ATOMIC_RELEASE );
+    Log::Debug() << "Tier-up: " << function->name << " is native\n";
+}
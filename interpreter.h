@@ -0,0 +1,55 @@
+#ifndef __INTERPRETER_H__
+#define __INTERPRETER_H__
+
+#include <deque>
+#include <pthread.h>
+#include "bytecode.h"
+#include "codegen.h"
+#include "perfmap.h"
+
+/*
+ *  Runs a program from its bytecode right away. Functions whose calls and
+ *  taken branches reach hotnessThreshold are compiled with LLVM on a
+ *  background thread and called natively from then on.
+ */
+class Interpreter {
+public:
+    bool tierUp;
+    unsigned hotnessThreshold;
+
+    /* target holds the triple and cpu used for the native code */
+    Interpreter( CodeGenContext& target );
+    ~Interpreter();
+
+    void run(StatementBlock& root);
+
+private:
+    CodeGenContext& target;
+    BytecodeProgram* program;
+
+    Slot* stack;
+    Slot* stackEnd;
+
+    Slot execute(BytecodeFunction* function, Slot* frame);
+    Slot call(BytecodeFunction* function, Slot* args);
+    Slot callMemoized(BytecodeFunction* function, Slot* args);
+    int print(const PrintfSite& site, Slot* args);
+
+    /* tier-up compile thread */
+    pthread_t compileThread;
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueCondition;
+    std::deque<BytecodeFunction*> compileQueue;
+    bool compileThreadStarted;
+    bool stopping;
+    ExecutionEngine* engine;
+    PerfMapListener* perfMap;           // with -g, for perf to name the native code
+
+    void requestCompile(BytecodeFunction* function);
+    static void* compileLoop(void* interpreter);
+    void compileNative(BytecodeFunction* function);
+    bool collectCallees(BytecodeFunction* function, std::map<BytecodeFunction*, int>& state,
+                        std::vector<BytecodeFunction*>& order);
+};
+
+#endif
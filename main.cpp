@@ -1,15 +1,19 @@
 #include "ast.h"
 #include "codegen.h"
+#include "interpreter.h"
 #include "log.h"
+#include "streaming.h"
 
-#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
+#include <string.h>
+#include <llvm/Support/FileSystem.h>
 
 using namespace std;
 
 extern StatementBlock* programBlock;
+extern TopLevelHandler* topLevelHandler;
 extern int yyparse();
 
 extern bool debugTokens;
@@ -23,37 +27,129 @@ void printAST(){
     cout << line << "\nAbstract Sintax Tree\n" << line << "\n";
 }
 
+/* Returns the value of an "<option>=<value>" argument, or NULL */
+const char* optionValue( const char* arg, const char* option ){
+    size_t length = strlen( option );
+    if( strncmp( arg, option, length ) == 0 && arg[length] == '=' ){
+        return arg + length + 1;
+    }
+    return NULL;
+}
+
 int main( int argc, char** argv ){
     debugTokens = true;
     debugAST = false;
     Log::isDebugLevel = false;
 
-    // lft-cc [ input-file ]
-    if( argc > 1 ){
-        freopen( argv[1], "r", stdin );
+    CodeGenContext context;
+    bool interpret = false;
+    bool tierUp = true;
+    bool stream = false;
+    bool printTargetFlags = false;
+
+    // lft-cc [ -march=<cpu>|native ] [ -mattr=<features> ] [ --target=<triple> ] [ -g ]
+    //        [ --whole-program ] [ --stream | --interpret [ --no-tier-up ] ] [ input-file ]
+    // lft-cc [ -march=... ] [ -mattr=... ] [ --target=... ] --print-target-flags
+    for( int i = 1; i < argc; ++i ){
+        const char* value;
+        if( strcmp( argv[i], "--interpret" ) == 0 ){
+            interpret = true;
+            debugTokens = false;
+        } else if( strcmp( argv[i], "--no-tier-up" ) == 0 ){
+            tierUp = false;
+        } else if( strcmp( argv[i], "-g" ) == 0 ){
+            context.debugInfo = true;
+        } else if( strcmp( argv[i], "--whole-program" ) == 0 ){
+            context.wholeProgram = true;
+        } else if( strcmp( argv[i], "--stream" ) == 0 ){
+            stream = true;
+        } else if( strcmp( argv[i], "--print-target-flags" ) == 0 ){
+            printTargetFlags = true;
+        } else if( (value = optionValue( argv[i], "-march" )) || (value = optionValue( argv[i], "-mcpu" )) ){
+            context.targetCPU = value;
+        } else if( (value = optionValue( argv[i], "-mattr" )) ){
+            context.targetFeatures = value;
+        } else if( (value = optionValue( argv[i], "--target" )) ){
+            context.targetTriple = value;
+        } else if( argv[i][0] == '-' ){
+            Log::Error() << "unknown option " << argv[i] << endl;
+            return -1;
+        } else {
+            freopen( argv[i], "r", stdin );
+            context.sourceFile = argv[i];
+        }
+    }
+
+    if( stream && interpret ){
+        Log::Error() << "--stream only applies to compilation, not to --interpret" << endl;
+        return -1;
+    }
+
+    if( !context.setupTarget() ){
+        return -1;
+    }
+
+    /* opt and llc 3.4 ignore the target-cpu/target-features function
+       attributes, they need the resolved target on their command line */
+    if( printTargetFlags ){
+        cout << "-mtriple=" << context.targetTriple;
+        if( !context.targetCPU.empty() ){
+            cout << " -mcpu=" << context.targetCPU;
+        }
+        if( !context.targetFeatures.empty() ){
+            cout << " -mattr=" << context.targetFeatures;
+        }
+        cout << endl;
+        return 0;
     }
 
     if( debugTokens ){
         cout << line << "\nTokens\n" << line << "\n";
     }
 
-    yyparse();
-
-    if( parseFailed ){
-        return -1;
+    if( stream ){
+        /* code is generated while parsing, there is no programBlock */
+        StreamingCompiler compiler( context );
+        topLevelHandler = &compiler;
+        context.beginCode();
+        yyparse();
+        topLevelHandler = NULL;
+        if( parseFailed ){
+            return -1;
+        }
+        Log::Debug() << "Streamed " << compiler.statements << " top level statements\n";
+    } else {
+        yyparse();
+        if( parseFailed ){
+            return -1;
+        }
     }
 
     if( debugAST ){
         printAST();
     }
 
-    CodeGenContext context;
-    Log::Debug() << line << "\nCode Generator\n" << line << "\n";
-    std::string asmCode = context.generateCode(*programBlock);
+    if( interpret ){
+        Interpreter interpreter( context );
+        interpreter.tierUp = tierUp;
+        interpreter.run( *programBlock );
+        return 0;
+    }
 
-    ofstream fout("out.ll");
-    fout << asmCode;
-    fout.close();
+    /* the module is printed straight to the file, never held as text */
+    std::string error;
+    raw_fd_ostream out( "out.ll", error, sys::fs::F_None );
+    if( !error.empty() ){
+        Log::Error() << "cannot write out.ll: " << error << endl;
+        return -1;
+    }
+
+    if( stream ){
+        context.finishCode( out );
+    } else {
+        Log::Debug() << line << "\nCode Generator\n" << line << "\n";
+        context.generateCode( *programBlock, out );
+    }
 
     return 0;
 }
@@ -5,6 +5,10 @@
 
 StatementBlock* programBlock;
 
+/* Top level statements go to topLevelHandler as soon as they are parsed
+   when it is set, else they are collected in programBlock */
+TopLevelHandler* topLevelHandler = NULL;
+
 extern int yylex();
 extern int lineNumber;
 extern char* yytext;
@@ -12,6 +16,17 @@ int yyerror( const char* err );
 
 bool parseFailed = false;
 
+static void topLevelStatement( Statement* statement ){
+    if( topLevelHandler != NULL ){
+        topLevelHandler->topLevel( statement );
+        return;
+    }
+    if( programBlock == NULL ){
+        programBlock = new StatementBlock();
+    }
+    programBlock->statements.push_back( statement );
+}
+
 %}
 
 %union {
@@ -27,6 +42,8 @@ bool parseFailed = false;
     Identifier*             ident;
     VariableList*           varList;
     ExpressionList*         exprList;
+    SwitchCase*             switchCase;
+    SwitchCaseList*         caseList;
 }
 
 /*
@@ -37,6 +54,8 @@ bool parseFailed = false;
 %token <token> T_EQUAL T_CMP_EQ T_CMP_NE T_CMP_LT T_CMP_LE T_PRINTF T_RETURN
 %token <token> T_CMP_GT T_CMP_GE T_LPAREN T_RPAREN T_LBRACE T_RBRACE
 %token <token> T_SEMI T_PLUS T_MINUS T_DIV T_MUL T_COMMA
+%token <token> T_SPAWN T_SYNC T_MEMO
+%token <token> T_SWITCH T_CASE T_DEFAULT T_COLON
 
 /*
  *  Rules Declaration
@@ -45,8 +64,12 @@ bool parseFailed = false;
 %type <expr>     numeric expr factor term arith_expr printf logic_expr fun_call
 %type <varVec>   func_decl_args
 %type <exprList> call_args
-%type <block>    program stmts block
+%type <block>    stmts block
 %type <stmt>     stmt var_decl func_decl return_stmt branch_stmt branch_stmt2
+%type <stmt>     spawn_stmt sync_stmt switch_stmt
+%type <switchCase> switch_case
+%type <caseList> switch_cases
+%type <token>    case_value
 %type <token>    comparison
 
 %left T_PLUS T_MINUS
@@ -56,7 +79,11 @@ bool parseFailed = false;
 
 %%
 
-program : stmts                         { programBlock = $1; }
+program : top_stmt
+        | program top_stmt
+;
+
+top_stmt : stmt T_SEMI                  { topLevelStatement( $1 ); }
 ;
 
 stmts   : stmt T_SEMI                   { $$ = new StatementBlock(); $$->statements.push_back($<stmt>1); }
@@ -67,6 +94,35 @@ stmt    : var_decl | func_decl | expr   { $$ = new ExpressionStatement( *$1 ); }
         | return_stmt                   { $$ = $1; }
         | branch_stmt                   { $$ = $1; }
         | branch_stmt2                  { $$ = $1; }
+        | spawn_stmt                    { $$ = $1; }
+        | sync_stmt                     { $$ = $1; }
+        | switch_stmt                   { $$ = $1; }
+;
+
+spawn_stmt : T_SPAWN fun_call           { $$ = new SpawnStatement( *static_cast<MethodCall*>($2) ); }
+           | T_SPAWN identifier T_EQUAL fun_call
+                                        { $$ = new SpawnStatement( *$2, *static_cast<MethodCall*>($4) ); }
+;
+
+sync_stmt : T_SYNC                      { $$ = new SyncStatement(); }
+;
+
+switch_stmt : T_SWITCH T_LPAREN expr T_RPAREN T_LBRACE switch_cases T_RBRACE
+                                        { $$ = new SwitchStatement( $3, *$6 ); delete $6; }
+;
+
+switch_cases : /* empty */              { $$ = new SwitchCaseList(); }
+             | switch_cases switch_case T_SEMI
+                                        { $1->push_back( $2 ); }
+;
+
+switch_case : T_CASE case_value T_COLON block
+                                        { $$ = new SwitchCase( $2, *$4 ); delete $4; }
+            | T_DEFAULT T_COLON block   { $$ = new SwitchCase( *$3 ); delete $3; }
+;
+
+case_value : T_NUM_INTEGER              { $$ = (int)$1; }
+           | T_MINUS T_NUM_INTEGER      { $$ = -(int)$2; }
 ;
 
 return_stmt : T_RETURN expr
@@ -74,10 +130,10 @@ return_stmt : T_RETURN expr
 ;
 
 branch_stmt : T_IF T_LPAREN expr T_RPAREN block T_ELSE block
-                                        { $$ = new BranchStatement( $3, *$5, *$7 ); }
+                                        { $$ = new BranchStatement( $3, *$5, *$7 ); delete $5; delete $7; }
 
 branch_stmt2 : T_IF T_LPAREN expr T_RPAREN block
-                                        { $$ = new BranchStatement( $3, *$5 ); }
+                                        { $$ = new BranchStatement( $3, *$5 ); delete $5; }
 ;
 
 block   : T_LBRACE stmts T_RBRACE       { $$ = $2; }
@@ -93,7 +149,12 @@ var_decl : identifier identifier        { $$ = new VariableDeclaration( *$1, *$2
 ;
 
 func_decl : identifier identifier T_LPAREN func_decl_args T_RPAREN block
-                                        { $$ = new FunctionDeclaration( *$1, *$2, *$4, *$6 ); }
+                                        { $$ = new FunctionDeclaration( *$1, *$2, *$4, *$6 ); delete $4; delete $6; }
+          | T_MEMO identifier identifier T_LPAREN func_decl_args T_RPAREN block
+                                        { FunctionDeclaration* function = new FunctionDeclaration( *$2, *$3, *$5, *$7 );
+                                          function->isMemoized = true;
+                                          delete $5; delete $7;
+                                          $$ = function; }
 ;
 
 func_decl_args  : /* empty */           { $$ = new VariableList(); }
@@ -117,7 +178,7 @@ expr : identifier T_EQUAL expr          { $$ = new Assignment(*$<ident>1, $3); }
 ;
 
 fun_call : identifier T_LPAREN call_args T_RPAREN
-                                        { $$ = new MethodCall(*$1, *$3); }
+                                        { $$ = new MethodCall(*$1, *$3); delete $3; }
 ;
 
 call_args : /*empty*/                   { $$ = new ExpressionList(); }
@@ -149,7 +210,7 @@ comparison : T_CMP_EQ | T_CMP_NE | T_CMP_LT | T_CMP_LE | T_CMP_GT | T_CMP_GE
 ;
 
 printf : T_PRINTF T_LPAREN T_STR T_COMMA call_args T_RPAREN
-                                        { $$ = new PrintfMethodCall( *$3, *$5 ); }
+                                        { $$ = new PrintfMethodCall( *$3, *$5 ); delete $3; delete $5; }
 ;
 %%
 
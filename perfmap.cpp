@@ -0,0 +1,36 @@
+#include "perfmap.h"
+#include "log.h"
+
+#include <unistd.h>
+#include <llvm/IR/Function.h>
+
+using namespace std;
+
+PerfMapListener::PerfMapListener()
+{
+    char path[64];
+    snprintf( path, sizeof(path), "/tmp/perf-%d.map", (int)getpid() );
+    file = fopen( path, "w" );
+    if( file == NULL ){
+        Log::Error() << "cannot write " << path << endl;
+    }
+}
+
+PerfMapListener::~PerfMapListener()
+{
+    if( file != NULL ){
+        fclose( file );
+    }
+}
+
+/* One "<start> <size> <name>" line in hex, flushed right away so the
+   map is complete when perf reads it, even if the program crashes */
+void PerfMapListener::NotifyFunctionEmitted(const Function &function, void *code, size_t size,
+                                            const EmittedFunctionDetails &details)
+{
+    if( file == NULL ){
+        return;
+    }
+    fprintf( file, "%lx %lx %s\n", (unsigned long)code, (unsigned long)size, function.getName().str().c_str() );
+    fflush( file );
+}
@@ -0,0 +1,26 @@
+#ifndef __PERFMAP_H__
+#define __PERFMAP_H__
+
+#include <stdio.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+using namespace llvm;
+
+/*
+ *  Writes the address, size and name of every function the JIT emits to
+ *  /tmp/perf-<pid>.map, where perf looks up symbols of code that has no
+ *  file on disk.
+ */
+class PerfMapListener : public JITEventListener {
+public:
+    PerfMapListener();
+    ~PerfMapListener();
+
+    virtual void NotifyFunctionEmitted(const Function &function, void *code, size_t size,
+                                       const EmittedFunctionDetails &details);
+
+private:
+    FILE* file;
+};
+
+#endif
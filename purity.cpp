@@ -0,0 +1,171 @@
+#include "purity.h"
+#include "log.h"
+
+using namespace std;
+
+bool PurityAnalysis::isPure(const String& name){
+    map<String, bool>::iterator it = pureFunctions.find(name);
+    return it != pureFunctions.end() && it->second;
+}
+
+/* Calls to a memoized function go through its cache, codegen ignores memo
+   on impure and void functions */
+static bool isMemoized(FunctionDeclaration& function){
+    return function.isMemoized && function.isPure && function.functionType.name != "void";
+}
+
+/* Finds the function declarations of block and of the blocks nested in it */
+void PurityAnalysis::collect(StatementBlock& block, vector<FunctionDeclaration*>& functions){
+    StatementList::iterator it;
+    for( it = block.statements.begin(); it != block.statements.end(); ++it ){
+        if( FunctionDeclaration* function = dynamic_cast<FunctionDeclaration*>(*it) ){
+            functions.push_back(function);
+            collect(function->block, functions);
+        } else if( BranchStatement* branch = dynamic_cast<BranchStatement*>(*it) ){
+            collect(branch->blockTrue, functions);
+            collect(branch->blockFalse, functions);
+        } else if( SwitchStatement* statement = dynamic_cast<SwitchStatement*>(*it) ){
+            SwitchCaseList::iterator c;
+            for( c = statement->cases.begin(); c != statement->cases.end(); ++c ){
+                collect((*c)->block, functions);
+            }
+        }
+    }
+}
+
+void PurityAnalysis::analyze(StatementBlock& root){
+    vector<FunctionDeclaration*> functions;
+    collect(root, functions);
+    infer(functions);
+}
+
+bool PurityAnalysis::analyze(FunctionDeclaration& function){
+    /* nested declarations are generated along with function and may call
+       each other, they go through the same fixpoint */
+    vector<FunctionDeclaration*> functions;
+    functions.push_back(&function);
+    collect(function.block, functions);
+    infer(functions);
+
+    return function.isPure;
+}
+
+/* Both fixpoints over functions, the functions analyzed before keep their result */
+void PurityAnalysis::infer(vector<FunctionDeclaration*>& functions){
+    /* start from all pure and remove the impure ones until nothing changes,
+       so recursive functions stay pure unless something else taints them */
+    vector<FunctionDeclaration*>::iterator it;
+    for( it = functions.begin(); it != functions.end(); ++it ){
+        pureFunctions[(*it)->functionName.name] = true;
+    }
+
+    bool changed = true;
+    while( changed ){
+        changed = false;
+        for( it = functions.begin(); it != functions.end(); ++it ){
+            const String& name = (*it)->functionName.name;
+            if( pureFunctions[name] && !isPure(&(*it)->block) ){
+                pureFunctions[name] = false;
+                changed = true;
+            }
+        }
+    }
+
+    for( it = functions.begin(); it != functions.end(); ++it ){
+        (*it)->isPure = pureFunctions[(*it)->functionName.name];
+        Log::Debug() << "Function " << (*it)->functionName.name
+                     << ((*it)->isPure ? " is pure\n" : " is impure\n");
+    }
+
+    /* same fixpoint for readnone, starting from the pure functions */
+    for( it = functions.begin(); it != functions.end(); ++it ){
+        readNoneFunctions[(*it)->functionName.name] = (*it)->isPure && !isMemoized(**it);
+    }
+
+    changed = true;
+    while( changed ){
+        changed = false;
+        for( it = functions.begin(); it != functions.end(); ++it ){
+            const String& name = (*it)->functionName.name;
+            if( readNoneFunctions[name] && !isPure(&(*it)->block, readNoneFunctions) ){
+                readNoneFunctions[name] = false;
+                changed = true;
+            }
+        }
+    }
+
+    for( it = functions.begin(); it != functions.end(); ++it ){
+        (*it)->isReadNone = readNoneFunctions[(*it)->functionName.name];
+    }
+}
+
+bool PurityAnalysis::isPure(Node* node){
+    return isPure(node, pureFunctions);
+}
+
+/* Whether node is pure when calling exactly the functions true in callees */
+bool PurityAnalysis::isPure(Node* node, map<String, bool>& callees){
+    if( node == NULL ){
+        return true;
+    }
+
+    if( dynamic_cast<Identifier*>(node) || dynamic_cast<Integer*>(node) || dynamic_cast<Double*>(node) ){
+        return true;
+    }
+    /* a nested declaration is a separate function */
+    if( dynamic_cast<FunctionDeclaration*>(node) ){
+        return true;
+    }
+    if( BinaryOperation* operation = dynamic_cast<BinaryOperation*>(node) ){
+        return isPure(&operation->lhs, callees) && isPure(&operation->rhs, callees);
+    }
+    if( Assignment* assignment = dynamic_cast<Assignment*>(node) ){
+        return isPure(assignment->rhs, callees);
+    }
+    if( MethodCall* call = dynamic_cast<MethodCall*>(node) ){
+        map<String, bool>::iterator callee = callees.find(call->methodName.name);
+        if( callee == callees.end() || !callee->second ){
+            return false;
+        }
+        ExpressionList::iterator it;
+        for( it = call->arguments.begin(); it != call->arguments.end(); ++it ){
+            if( !isPure(*it, callees) ){
+                return false;
+            }
+        }
+        return true;
+    }
+    if( StatementBlock* block = dynamic_cast<StatementBlock*>(node) ){
+        StatementList::iterator it;
+        for( it = block->statements.begin(); it != block->statements.end(); ++it ){
+            if( !isPure(*it, callees) ){
+                return false;
+            }
+        }
+        return true;
+    }
+    if( ExpressionStatement* statement = dynamic_cast<ExpressionStatement*>(node) ){
+        return isPure(&statement->expression, callees);
+    }
+    if( VariableDeclaration* declaration = dynamic_cast<VariableDeclaration*>(node) ){
+        return isPure(declaration->assignmentExpression, callees);
+    }
+    if( ReturnStatement* statement = dynamic_cast<ReturnStatement*>(node) ){
+        return isPure(statement->value, callees);
+    }
+    if( BranchStatement* branch = dynamic_cast<BranchStatement*>(node) ){
+        return isPure(branch->testExpression, callees) && isPure(&branch->blockTrue, callees) && isPure(&branch->blockFalse, callees);
+    }
+    if( SwitchStatement* statement = dynamic_cast<SwitchStatement*>(node) ){
+        SwitchCaseList::iterator it;
+        for( it = statement->cases.begin(); it != statement->cases.end(); ++it ){
+            if( !isPure(&(*it)->block, callees) ){
+                return false;
+            }
+        }
+        return isPure(statement->testExpression, callees);
+    }
+
+    /* printf, spawn, sync and anything unknown */
+    return false;
+}
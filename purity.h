@@ -0,0 +1,38 @@
+#ifndef __PURITY_H__
+#define __PURITY_H__
+
+#include <map>
+#include "ast.h"
+
+/*
+ *  A function is pure when it only computes on its arguments and locals:
+ *  no printf, no spawn/sync and only calls to pure functions. Pure
+ *  functions may be memoized. The memo cache is memory written behind
+ *  the caller's back, so only the pure functions that are not memoized
+ *  and call no memoized function are marked readnone (isReadNone).
+ */
+class PurityAnalysis {
+public:
+    /* Infers isPure for every function declared in root, including
+       mutually recursive ones */
+    void analyze(StatementBlock& root);
+
+    /* Infers isPure for a function and the ones nested in it from the
+       functions seen so far, calls to functions not seen yet are impure */
+    bool analyze(FunctionDeclaration& function);
+
+    bool isPure(const String& name);
+
+private:
+    std::map<String, bool> pureFunctions;
+
+    /* pure and never reaching a memo cache, safe to mark readnone */
+    std::map<String, bool> readNoneFunctions;
+
+    void collect(StatementBlock& block, std::vector<FunctionDeclaration*>& functions);
+    void infer(std::vector<FunctionDeclaration*>& functions);
+    bool isPure(Node* node);
+    bool isPure(Node* node, std::map<String, bool>& callees);
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "poulprt.h"
+
+#include <deque>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ *  Work-stealing pool: one deque per worker, the owner pushes and pops at
+ *  the back, thieves take from the front. The thread that first spawns
+ *  (the program's main thread) is worker 0, the others are started with it.
+ *  POULP_NUM_WORKERS overrides the number of workers (default: one per cpu).
+ */
+
+struct Task {
+    PoulpTaskFunction fn;
+    void* frame;
+    int* group;
+};
+
+struct Worker {
+    pthread_mutex_t lock;
+    std::deque<Task> tasks;
+};
+
+static Worker* workers = NULL;
+static int workerCount = 1;
+
+static __thread int workerId = 0;
+static __thread unsigned int stealSeed = 0;
+
+/* idle workers sleep until a task is queued */
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idleCondition = PTHREAD_COND_INITIALIZER;
+static int pendingTasks = 0;
+static int sleepingWorkers = 0;
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+static bool popTask( Task& task ){
+    Worker& self = workers[workerId];
+    bool found = false;
+
+    pthread_mutex_lock( &self.lock );
+    if( !self.tasks.empty() ){
+        task = self.tasks.back();
+        self.tasks.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock( &self.lock );
+
+    return found;
+}
+
+static bool stealTask( Task& task ){
+    if( workerCount < 2 ){
+        return false;
+    }
+
+    int start = rand_r( &stealSeed ) % workerCount;
+    for( int i = 0; i < workerCount; ++i ){
+        int victim = (start + i) % workerCount;
+        if( victim == workerId ){
+            continue;
+        }
+
+        Worker& other = workers[victim];
+        bool found = false;
+
+        pthread_mutex_lock( &other.lock );
+        if( !other.tasks.empty() ){
+            task = other.tasks.front();
+            other.tasks.pop_front();
+            found = true;
+        }
+        pthread_mutex_unlock( &other.lock );
+
+        if( found ){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool findTask( Task& task ){
+    if( popTask( task ) || stealTask( task ) ){
+        __atomic_sub_fetch( &pendingTasks, 1, __ATOMIC_SEQ_CST );
+        return true;
+    }
+    return false;
+}
+
+static void runTask( const Task& task ){
+    task.fn( task.frame );
+    __atomic_sub_fetch( task.group, 1, __ATOMIC_SEQ_CST );
+}
+
+static void* workerLoop( void* arg ){
+    workerId = (int)(long)arg;
+    stealSeed = workerId;
+
+    Task task;
+    for( ;; ){
+        if( findTask( task ) ){
+            runTask( task );
+            continue;
+        }
+
+        pthread_mutex_lock( &idleLock );
+        __atomic_add_fetch( &sleepingWorkers, 1, __ATOMIC_SEQ_CST );
+        while( __atomic_load_n( &pendingTasks, __ATOMIC_SEQ_CST ) == 0 ){
+            pthread_cond_wait( &idleCondition, &idleLock );
+        }
+        __atomic_sub_fetch( &sleepingWorkers, 1, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &idleLock );
+    }
+    return NULL;
+}
+
+static void initRuntime(){
+    const char* env = getenv( "POULP_NUM_WORKERS" );
+    workerCount = env ? atoi( env ) : (int)sysconf( _SC_NPROCESSORS_ONLN );
+    if( workerCount < 1 ){
+        workerCount = 1;
+    }
+
+    workers = new Worker[workerCount];
+    for( int i = 0; i < workerCount; ++i ){
+        pthread_mutex_init( &workers[i].lock, NULL );
+    }
+
+    for( int i = 1; i < workerCount; ++i ){
+        pthread_t thread;
+        if( pthread_create( &thread, NULL, workerLoop, (void*)(long)i ) != 0 ){
+            fprintf( stderr, "poulp: cannot start worker %d\n", i );
+            abort();
+        }
+        pthread_detach( thread );
+    }
+}
+
+void poulp_spawn( int* group, PoulpTaskFunction fn, void* frame ){
+    pthread_once( &initOnce, initRuntime );
+
+    Task task = { fn, frame, group };
+    __atomic_add_fetch( group, 1, __ATOMIC_SEQ_CST );
+    __atomic_add_fetch( &pendingTasks, 1, __ATOMIC_SEQ_CST );
+
+    Worker& self = workers[workerId];
+    pthread_mutex_lock( &self.lock );
+    self.tasks.push_back( task );
+    pthread_mutex_unlock( &self.lock );
+
+    if( __atomic_load_n( &sleepingWorkers, __ATOMIC_SEQ_CST ) > 0 ){
+        pthread_mutex_lock( &idleLock );
+        pthread_cond_signal( &idleCondition );
+        pthread_mutex_unlock( &idleLock );
+    }
+}
+
+void poulp_sync( int* group ){
+    Task task;
+    while( __atomic_load_n( group, __ATOMIC_SEQ_CST ) > 0 ){
+        if( findTask( task ) ){
+            runTask( task );
+        } else {
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef __POULPRT_H__
+#define __POULPRT_H__
+
+/*
+ *  Poulp runtime, linked into every generated executable.
+ *
+ *  spawn/sync are lowered by the code generator to these calls. Every
+ *  function that spawns owns a group counter (an i32 on its stack), each
+ *  spawned task increments it and decrements it once finished.
+ */
+
+extern "C" {
+
+typedef void (*PoulpTaskFunction)( void* frame );
+
+/* Queue fn(frame) on the calling worker, it may be stolen by any other worker */
+void poulp_spawn( int* group, PoulpTaskFunction fn, void* frame );
+
+/* Wait until every task of the group has finished, running queued tasks meanwhile */
+void poulp_sync( int* group );
+
+}
+
+#endif
@@ -0,0 +1,20 @@
+#include "streaming.h"
+#include "log.h"
+
+#include <typeinfo>
+
+using namespace std;
+
+void StreamingCompiler::topLevel( Statement* statement )
+{
+    Log::Debug() << "Streaming " << typeid(*statement).name() << " at line " << statement->line << endl;
+
+    switches.run( statement );
+    if( FunctionDeclaration* function = dynamic_cast<FunctionDeclaration*>(statement) ){
+        purity.analyze( *function );
+    }
+
+    context.emitTopLevel( *statement );
+    delete statement;
+    ++statements;
+}
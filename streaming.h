@@ -0,0 +1,31 @@
+#ifndef __STREAMING_H__
+#define __STREAMING_H__
+
+#include "ast.h"
+#include "codegen.h"
+#include "purity.h"
+#include "switchconversion.h"
+
+/*
+ *  Generates each top level statement as soon as the parser completes it
+ *  and deletes its AST right after, so only one top level syntax tree is
+ *  kept at a time. The generated code accumulates in the module until
+ *  finishCode prints it. Calls to functions defined further down go
+ *  through forward declarations, and a function calling one of them is
+ *  not known to be pure.
+ */
+class StreamingCompiler : public TopLevelHandler {
+public:
+    int statements;
+
+    StreamingCompiler( CodeGenContext& context ) : statements( 0 ), context( context ) { }
+
+    virtual void topLevel( Statement* statement );
+
+private:
+    CodeGenContext& context;
+    SwitchConversion switches;
+    PurityAnalysis purity;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#include "switchconversion.h"
+#include "log.h"
+#include "parser.hpp"
+
+#include <set>
+
+using namespace std;
+
+void SwitchConversion::run(StatementBlock& root){
+    convertBlock(root, Scope());
+    Log::Debug() << "Converted " << converted << " if chains to switch\n";
+}
+
+/* The top level variables declared by the statements seen so far stay in scope */
+void SwitchConversion::run(Statement*& statement){
+    convertStatement(statement, topLevel);
+}
+
+void SwitchConversion::convertBlock(StatementBlock& block, Scope scope){
+    StatementList::iterator it;
+    for( it = block.statements.begin(); it != block.statements.end(); ++it ){
+        convertStatement(*it, scope);
+    }
+}
+
+void SwitchConversion::convertStatement(Statement*& statement, Scope& scope){
+    if( VariableDeclaration* declaration = dynamic_cast<VariableDeclaration*>(statement) ){
+        scope[declaration->name.name] = declaration->type.name == "int";
+    } else if( FunctionDeclaration* function = dynamic_cast<FunctionDeclaration*>(statement) ){
+        Scope arguments;
+        VariableList::iterator arg;
+        for( arg = function->arguments.begin(); arg != function->arguments.end(); ++arg ){
+            arguments[(*arg)->name.name] = (*arg)->type.name == "int";
+        }
+        convertBlock(function->block, arguments);
+    } else if( BranchStatement* branch = dynamic_cast<BranchStatement*>(statement) ){
+        if( SwitchStatement* converted = convertChain(branch, scope) ){
+            delete branch;
+            statement = converted;
+        } else {
+            convertBlock(branch->blockTrue, scope);
+            convertBlock(branch->blockFalse, scope);
+        }
+    }
+
+    if( SwitchStatement* switchStatement = dynamic_cast<SwitchStatement*>(statement) ){
+        SwitchCaseList::iterator c;
+        for( c = switchStatement->cases.begin(); c != switchStatement->cases.end(); ++c ){
+            convertBlock((*c)->block, scope);
+        }
+    }
+}
+
+/* Follows the else branches as long as they hold a single if comparing the
+   same variable. The blocks move to the switch, what is left of the chain
+   is the caller's to delete */
+SwitchStatement* SwitchConversion::convertChain(BranchStatement* head, const Scope& scope){
+    vector<BranchStatement*> chain;
+    vector<int> values;
+    String variable;
+
+    BranchStatement* branch = head;
+    while( branch != NULL ){
+        String name;
+        int value;
+        if( !matchCase(branch->testExpression, scope, name, value) ){
+            break;
+        }
+        if( !chain.empty() && name != variable ){
+            break;
+        }
+        variable = name;
+        chain.push_back(branch);
+        values.push_back(value);
+
+        branch = NULL;
+        if( chain.back()->hasFalseBranch && chain.back()->blockFalse.statements.size() == 1 ){
+            branch = dynamic_cast<BranchStatement*>(chain.back()->blockFalse.statements[0]);
+        }
+    }
+
+    if( chain.size() < MinimumCases ){
+        return NULL;
+    }
+
+    SwitchCaseList cases;
+    set<int> seen;
+    for( size_t i = 0; i < chain.size(); ++i ){
+        /* a repeated value can never match again */
+        if( !seen.insert(values[i]).second ){
+            continue;
+        }
+        cases.push_back(new SwitchCase(values[i], chain[i]->blockTrue));
+    }
+
+    BranchStatement* last = chain.back();
+    if( last->hasFalseBranch ){
+        cases.push_back(new SwitchCase(last->blockFalse));
+    }
+
+    Log::Debug() << "Converting if chain on " << variable << " with " << cases.size() << " cases\n";
+    ++converted;
+    SwitchStatement* statement = new SwitchStatement(new Identifier(*new String(variable)), cases);
+    statement->line = chain.front()->line;
+    return statement;
+}
+
+/* Matches <int variable> == <constant> and <constant> == <int variable> */
+bool SwitchConversion::matchCase(Expression* test, const Scope& scope, String& variable, int& value){
+    BinaryOperation* operation = dynamic_cast<BinaryOperation*>(test);
+    if( operation == NULL || operation->op != T_CMP_EQ ){
+        return false;
+    }
+
+    Identifier* identifier = dynamic_cast<Identifier*>(&operation->lhs);
+    Expression* constant = &operation->rhs;
+    if( identifier == NULL ){
+        identifier = dynamic_cast<Identifier*>(&operation->rhs);
+        constant = &operation->lhs;
+    }
+    if( identifier == NULL || !matchConstant(constant, value) ){
+        return false;
+    }
+
+    Scope::const_iterator it = scope.find(identifier->name);
+    if( it == scope.end() || !it->second ){
+        return false;
+    }
+
+    variable = identifier->name;
+    return true;
+}
+
+/* An integer, or the 0 - integer the parser makes of a negative one */
+bool SwitchConversion::matchConstant(Expression* expression, int& value){
+    if( Integer* integer = dynamic_cast<Integer*>(expression) ){
+        value = integer->value;
+        return true;
+    }
+
+    BinaryOperation* operation = dynamic_cast<BinaryOperation*>(expression);
+    if( operation != NULL && operation->op == T_MINUS ){
+        Integer* zero = dynamic_cast<Integer*>(&operation->lhs);
+        Integer* integer = dynamic_cast<Integer*>(&operation->rhs);
+        if( zero != NULL && zero->value == 0 && integer != NULL ){
+            value = -integer->value;
+            return true;
+        }
+    }
+    return false;
+}
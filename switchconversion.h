@@ -0,0 +1,42 @@
+#ifndef __SWITCHCONVERSION_H__
+#define __SWITCHCONVERSION_H__
+
+#include <map>
+#include "ast.h"
+
+/*
+ *  Rewrites if/else chains comparing one int variable with constants,
+ *
+ *      if (x == 1) { A; } else { if (x == 2) { B; } else { if (x == 3) { C; } else { D; }; }; };
+ *
+ *  into a switch statement, so they become one jump table or binary
+ *  search instead of a compare and branch per case.
+ */
+class SwitchConversion {
+public:
+    /* shorter chains are left as they are */
+    static const size_t MinimumCases = 3;
+
+    int converted;
+
+    SwitchConversion() : converted( 0 ) { }
+
+    void run(StatementBlock& root);
+
+    /* Converts one top level statement, replacing it when it is a chain */
+    void run(Statement*& statement);
+
+private:
+    /* variables in scope, true for the int ones */
+    typedef std::map<String, bool> Scope;
+
+    Scope topLevel;
+
+    void convertBlock(StatementBlock& block, Scope scope);
+    void convertStatement(Statement*& statement, Scope& scope);
+    SwitchStatement* convertChain(BranchStatement* head, const Scope& scope);
+    bool matchCase(Expression* test, const Scope& scope, String& variable, int& value);
+    bool matchConstant(Expression* expression, int& value);
+};
+
+#endif